@@ -28,8 +28,11 @@ THE SOFTWARE.
 #ifndef ARFER_H
 #define ARFER_H
 
+#include <vector>
+#include <boost/array.hpp>
 #include <boost/math/distributions/chi_squared.hpp>
 #include <boost/math/distributions/hypergeometric.hpp>
+#include <boost/math/special_functions/round.hpp>
 
 namespace vcfaid
 {
@@ -63,41 +66,311 @@ namespace vcfaid
     }
   }
 
-  template<typename TConfig, typename TGlVector, typename TValue>
+  // Likelihoods from log10-scaled GLs, normalized by the most likely genotype
+  // The best genotype is always 1, so extreme GLs (e.g. -300) never underflow all genotypes to 0
+  template<typename TLikelihoods>
+  inline void
+  _scaledLikelihoods(float const* gl, TLikelihoods& lik) {
+    typedef typename TLikelihoods::value_type TValue;
+    float maxGl = gl[0];
+    for(std::size_t k = 1; k < lik.size(); ++k)
+      if (gl[k] > maxGl) maxGl = gl[k];
+    for(std::size_t k = 0; k < lik.size(); ++k) lik[k] = std::pow((TValue) 10.0, (TValue) gl[k] - (TValue) maxGl);
+  }
+
+  // PLs above are treated as impossible genotypes (10^-300 is close to the smallest normal double)
+  static const int32_t PHRED_MAX = 3000;
+
+  template<typename TValue>
+  inline std::vector<TValue>
+  _buildPhredTable() {
+    std::vector<TValue> table;
+    phred2Prob((uint32_t) PHRED_MAX, table);
+    table.push_back(0);
+    return table;
+  }
+
+  // Likelihoods from phred-scaled PLs, normalized by the most likely genotype
+  template<typename TLikelihoods>
+  inline void
+  _scaledLikelihoods(int32_t const* pl, TLikelihoods& lik) {
+    typedef typename TLikelihoods::value_type TValue;
+    static std::vector<TValue> const phred = _buildPhredTable<TValue>();
+    int32_t minPl = pl[0];
+    for(std::size_t k = 1; k < lik.size(); ++k)
+      if (pl[k] < minPl) minPl = pl[k];
+    if (minPl < 0) {
+      // Missing PLs
+      for(std::size_t k = 0; k < lik.size(); ++k) lik[k] = 0;
+      return;
+    }
+    for(std::size_t k = 0; k < lik.size(); ++k) lik[k] = phred[std::min(pl[k] - minPl, PHRED_MAX + 1)];
+  }
+
+  // Plain running sum of per-sample terms
+  template<typename TValue>
+  struct PlainSum {
+    TValue sum;
+
+    PlainSum() : sum(0) {}
+    inline void add(TValue const v) { sum += v; }
+    inline TValue value() const { return sum; }
+  };
+
+  // Kahan compensated sum, keeps single-precision accumulations over large cohorts accurate
+  template<typename TValue>
+  struct KahanSum {
+    TValue sum;
+    TValue comp;
+
+    KahanSum() : sum(0), comp(0) {}
+    inline void add(TValue const v) {
+      TValue y = v - comp;
+      TValue t = sum + y;
+      comp = (t - sum) - y;
+      sum = t;
+    }
+    inline TValue value() const { return sum; }
+  };
+
+  // Reproducible sum: fixed tiles of samples are summed in order, tile sums are combined pairwise in a
+  // tree that only depends on the tile index. The result only depends on the order of the terms, and the
+  // rounding error grows with the log of the number of tiles.
+  template<typename TValue>
+  struct BlockedSum {
+    static const std::size_t tileSize = 256;
+
+    TValue tile;
+    std::size_t n;        // Terms in the current tile
+    uint64_t ntiles;      // Bit k set: level[k] holds the sum of 2^k tiles
+    TValue level[64];
+
+    BlockedSum() : tile(0), n(0), ntiles(0) {}
+    inline void add(TValue const v) {
+      tile += v;
+      if (++n == tileSize) {
+	// Full tile, combined with the stored sums of as many tiles
+	std::size_t k = 0;
+	for(; (ntiles >> k) & 1; ++k) tile = level[k] + tile;
+	level[k] = tile;
+	++ntiles;
+	tile = 0;
+	n = 0;
+      }
+    }
+    inline TValue value() const {
+      TValue s = tile;
+      for(std::size_t k = 0; k < 64; ++k)
+	if ((ntiles >> k) & 1) s = level[k] + s;
+      return s;
+    }
+  };
+
+  // Default summation for a given precision
+  template<typename TValue>
+  struct SumTraits {
+    typedef PlainSum<TValue> TSum;
+  };
+
+  template<>
+  struct SumTraits<float> {
+    typedef KahanSum<float> TSum;
+  };
+
+  template<typename TValue>
+  struct BiallelicEstimate {
+    TValue hweAF[2];
+    TValue mleGTFreq[3];
+    TValue fic;
+    TValue rsq;
+    TValue hwepval;
+  };
+
+  // Genotype frequencies under HWE
+  template<typename TValue>
+  inline void
+  _hweGenotypes(TValue const (&af)[2], TValue (&hweGT)[3]) {
+    hweGT[0] = af[0] * af[0];
+    hweGT[1] = 2 * af[0] * af[1];
+    hweGT[2] = af[1] * af[1];
+  }
+
+  // Per-sample E-step of the allele frequency EM, false if the likelihoods are incompatible with the prior
+  template<typename TGLs, typename TValue, typename TSum>
+  inline bool
+  _afStep(TGLs const& gl, TValue const (&gtprior)[3], TSum (&sumAF)[2]) {
+    TValue gt[3];
+    gt[0] = gtprior[0] * gl[0];
+    gt[1] = gtprior[1] * gl[1];
+    gt[2] = gtprior[2] * gl[2];
+    TValue p = gt[0] + gt[1] + gt[2];
+    if (!(p > 0)) return false;
+    gt[0] /= p;
+    gt[1] /= p;
+    gt[2] /= p;
+    sumAF[0].add(gt[0] + (TValue) 0.5 * gt[1]);
+    sumAF[1].add(gt[2] + (TValue) 0.5 * gt[1]);
+    return true;
+  }
+
+  // M-step of the allele frequency EM, returns the squared change
+  template<typename TSum, typename TValue>
+  inline TValue
+  _afUpdate(TSum const (&sumAF)[2], std::size_t const numGl, TValue (&afprior)[2], TValue (&hweAF)[2]) {
+    hweAF[0] = sumAF[0].value() / (TValue) numGl;
+    hweAF[1] = sumAF[1].value() / (TValue) numGl;
+    TValue err = (afprior[0]-hweAF[0])*(afprior[0]-hweAF[0]) + (afprior[1]-hweAF[1])*(afprior[1]-hweAF[1]);
+    afprior[0] = hweAF[0];
+    afprior[1] = hweAF[1];
+    return err;
+  }
+
+  template<typename TGLs, typename TValue, typename TSum>
+  inline bool
+  _gtFreqStep(TGLs const& gl, TValue const (&prior)[3], TSum (&sumGT)[3]) {
+    TValue gt[3];
+    gt[0] = prior[0] * gl[0];
+    gt[1] = prior[1] * gl[1];
+    gt[2] = prior[2] * gl[2];
+    TValue p = gt[0] + gt[1] + gt[2];
+    if (!(p > 0)) return false;
+    sumGT[0].add(gt[0]/p);
+    sumGT[1].add(gt[1]/p);
+    sumGT[2].add(gt[2]/p);
+    return true;
+  }
+
+  template<typename TSum, typename TValue>
+  inline TValue
+  _gtFreqUpdate(TSum const (&sumGT)[3], std::size_t const numGl, TValue (&prior)[3], TValue (&mleGTFreq)[3]) {
+    mleGTFreq[0] = sumGT[0].value() / (TValue) numGl;
+    mleGTFreq[1] = sumGT[1].value() / (TValue) numGl;
+    mleGTFreq[2] = sumGT[2].value() / (TValue) numGl;
+    TValue err = (prior[0]-mleGTFreq[0])*(prior[0]-mleGTFreq[0]) + (prior[1]-mleGTFreq[1])*(prior[1]-mleGTFreq[1]) + (prior[2]-mleGTFreq[2])*(prior[2]-mleGTFreq[2]);
+    prior[0] = mleGTFreq[0];
+    prior[1] = mleGTFreq[1];
+    prior[2] = mleGTFreq[2];
+    return err;
+  }
+
+  template<typename TGLs, typename TValue, typename TSum>
+  inline void
+  _ficStep(TGLs const& gl, TValue const (&hweGT)[3], TSum& sumGLHet, TSum& denominator) {
+    TValue p = gl[0] * hweGT[0] + gl[1] * hweGT[1] + gl[2] * hweGT[2];
+    if (!(p > 0)) return;
+    sumGLHet.add((gl[1] * hweGT[1]) / p);
+    denominator.add(hweGT[1]);
+  }
+
+  template<typename TSum, typename TValue>
+  inline void
+  _ficFinal(TSum const& sumGLHet, TSum const& denominator, TValue& F) {
+    if (denominator.value() > 0) F = 1 - sumGLHet.value() / denominator.value();
+  }
+
+  template<typename TGLs, typename TValue, typename TSum>
+  inline bool
+  _rsqStep(TGLs const& gl, TValue const (&hweGT)[3], TSum& sumDosage, TSum& sumDosage2) {
+    TValue post[3];
+    post[0] = gl[0] * hweGT[0];
+    post[1] = gl[1] * hweGT[1];
+    post[2] = gl[2] * hweGT[2];
+    TValue p = post[0] + post[1] + post[2];
+    if (!(p > 0)) return false;
+    post[0] /= p;
+    post[1] /= p;
+    post[2] /= p;
+    sumDosage.add(post[1] + 2 * post[0]);  // genetic variance 2 * post[0] + 1 * post[1] + 0 * post[2]
+    sumDosage2.add((post[1] + 2 * post[0]) * (post[1] + 2 * post[0]));
+    return true;
+  }
+
+  template<typename TSum, typename TValue>
+  inline void
+  _rsqFinal(TSum const& sumDosage, TSum const& sumDosage2, std::size_t const numValid, TValue const (&hweGT)[3], TValue& rsq) {
+    if (numValid < 2) return;
+    TValue numSample = numValid;
+    TValue meanD = sumDosage.value() / numSample;
+    TValue sumD2 = (sumDosage2.value() - numSample * meanD * meanD);
+    if (sumD2 < 0) sumD2 = 0;
+    sumD2 /= (numSample - 1);
+    rsq = sumD2 / hweGT[1];
+  }
+
+  template<typename TGLs, typename TValue, typename TSum>
+  inline void
+  _hweStep(TGLs const& gl, TValue const (&hweGT)[3], TValue const (&mleGTFreq)[3], TSum& null, TSum& alt) {
+    TValue pNull = gl[0] * hweGT[0] + gl[1] * hweGT[1] + gl[2] * hweGT[2];
+    TValue pAlt = gl[0] * mleGTFreq[0] + gl[1] * mleGTFreq[1] + gl[2] * mleGTFreq[2];
+    if ((!(pNull > 0)) || (!(pAlt > 0))) return;
+    null.add(std::log(pNull));
+    alt.add(std::log(pAlt));
+  }
+
+  template<typename TSum, typename TValue>
+  inline void
+  _hweFinal(TSum const& null, TSum const& alt, TValue& pvalue) {
+    double lrts = -2 * ((double) null.value() - (double) alt.value());
+    if (lrts < 0) lrts = 0;
+    boost::math::chi_squared chisqDist(1);
+    pvalue = boost::math::cdf(complement(chisqDist, lrts));  // Probability that the variable takes a value > lrts
+  }
+
+  // Haploid E-step, the allele frequencies are the genotype frequencies
+  template<typename TGLs, typename TValue, typename TSum>
+  inline bool
+  _afStep(TGLs const& gl, TValue const (&afprior)[2], TSum (&sumAF)[2]) {
+    TValue gt[2];
+    gt[0] = afprior[0] * gl[0];
+    gt[1] = afprior[1] * gl[1];
+    TValue p = gt[0] + gt[1];
+    if (!(p > 0)) return false;
+    sumAF[0].add(gt[0]/p);
+    sumAF[1].add(gt[1]/p);
+    return true;
+  }
+
+  template<typename TGLs, typename TValue, typename TSum>
+  inline bool
+  _rsqStep(TGLs const& gl, TValue const (&af)[2], TSum& sumDosage, TSum& sumDosage2) {
+    TValue p = gl[0] * af[0] + gl[1] * af[1];
+    if (!(p > 0)) return false;
+    TValue dosage = gl[0] * af[0] / p;
+    sumDosage.add(dosage);
+    sumDosage2.add(dosage * dosage);
+    return true;
+  }
+
+  template<typename TSum, typename TValue>
+  inline void
+  _rsqFinal(TSum const& sumDosage, TSum const& sumDosage2, std::size_t const numValid, TValue const (&af)[2], TValue& rsq) {
+    if (numValid < 2) return;
+    TValue numSample = numValid;
+    TValue meanD = sumDosage.value() / numSample;
+    TValue sumD2 = (sumDosage2.value() - numSample * meanD * meanD);
+    if (sumD2 < 0) sumD2 = 0;
+    sumD2 /= (numSample - 1);
+    rsq = sumD2 / (af[0] * af[1]);
+  }
+
+
+  template<typename TSum, typename TConfig, typename TGlVector, typename TValue>
   inline void
   _estBiallelicAF(TConfig const& c, TGlVector const& glVector, TValue (&hweAF)[2]) {
     if (!glVector.empty()) {
-      TValue numGl = glVector.size();
       TValue afprior[2];
-      afprior[0] = 0.5;
-      afprior[1] = 0.5;
+      afprior[0] = (TValue) 0.5;
+      afprior[1] = (TValue) 0.5;
       TValue gtprior[3];
-      TValue gt[3];
-      TValue p;
       TValue err = 1;
       for(std::size_t count = 0; ((err > c.epsilon) && (count<c.maxiter)); ++count) {
-	gtprior[0] = afprior[0] * afprior[0];
-	gtprior[1] = 2 * afprior[0] * afprior[1];
-	gtprior[2] = afprior[1] * afprior[1];
-      
-	hweAF[0] = 0;
-	hweAF[1] = 0;
-	for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG) {
-	  gt[0] = gtprior[0] * itG->at(0);
-	  gt[1] = gtprior[1] * itG->at(1);
-	  gt[2] = gtprior[2] * itG->at(2);
-	  p = gt[0] + gt[1] + gt[2];
-	  gt[0] /= p;
-	  gt[1] /= p;
-	  gt[2] /= p;
-	  hweAF[0] += gt[0] + 0.5 * gt[1];
-	  hweAF[1] += gt[2] + 0.5 * gt[1];
-	}
-	hweAF[0] /= numGl;
-	hweAF[1] /= numGl;
-	err = (afprior[0]-hweAF[0])*(afprior[0]-hweAF[0]) + (afprior[1]-hweAF[1])*(afprior[1]-hweAF[1]);
-	afprior[0] = hweAF[0];
-	afprior[1] = hweAF[1];
+	_hweGenotypes(afprior, gtprior);
+	TSum sumAF[2];
+	std::size_t numGl = 0;
+	for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	  if (_afStep(*itG, gtprior, sumAF)) ++numGl;
+	if (!numGl) break;
+	err = _afUpdate(sumAF, numGl, afprior, hweAF);
       }
     }
   }
@@ -105,115 +378,192 @@ namespace vcfaid
 
   template<typename TConfig, typename TGlVector, typename TValue>
   inline void
+  _estBiallelicAF(TConfig const& c, TGlVector const& glVector, TValue (&hweAF)[2]) {
+    _estBiallelicAF<typename SumTraits<TValue>::TSum>(c, glVector, hweAF);
+  }
+
+
+  template<typename TSum, typename TConfig, typename TGlVector, typename TValue>
+  inline void
   _estBiallelicGTFreq(TConfig const& c, TGlVector const& glVector, TValue (&mleGTFreq)[3]) {
     if (!glVector.empty()) {
-      TValue numGl = glVector.size();
       TValue prior[3];
-      prior[0] = 1.0/3.0;
-      prior[1] = 1.0/3.0;
-      prior[2] = 1.0/3.0;
-      TValue gt[3];
-      TValue p;
+      prior[0] = (TValue) 1.0 / (TValue) 3.0;
+      prior[1] = (TValue) 1.0 / (TValue) 3.0;
+      prior[2] = (TValue) 1.0 / (TValue) 3.0;
       TValue err = 1;
       for(std::size_t count = 0; ((err > c.epsilon) && (count<c.maxiter)); ++count) {
-	mleGTFreq[0] = 0;
-	mleGTFreq[1] = 0;
-	mleGTFreq[2] = 0;
-	for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG) {
-	  gt[0] = prior[0] * itG->at(0);
-	  gt[1] = prior[1] * itG->at(1);
-	  gt[2] = prior[2] * itG->at(2);
-	  p = gt[0] + gt[1] + gt[2];
-	  mleGTFreq[0] += gt[0]/p;
-	  mleGTFreq[1] += gt[1]/p;
-	  mleGTFreq[2] += gt[2]/p;
-	}
-	mleGTFreq[0] /= numGl;
-	mleGTFreq[1] /= numGl;
-	mleGTFreq[2] /= numGl;
-	err = (prior[0]-mleGTFreq[0])*(prior[0]-mleGTFreq[0]) + (prior[1]-mleGTFreq[1])*(prior[1]-mleGTFreq[1]) + (prior[2]-mleGTFreq[2])*(prior[2]-mleGTFreq[2]);
-	prior[0] = mleGTFreq[0];
-	prior[1] = mleGTFreq[1];
-	prior[2] = mleGTFreq[2];
+	TSum sumGT[3];
+	std::size_t numGl = 0;
+	for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	  if (_gtFreqStep(*itG, prior, sumGT)) ++numGl;
+	if (!numGl) break;
+	err = _gtFreqUpdate(sumGT, numGl, prior, mleGTFreq);
       }
     }
   }
 
 
-  template<typename TGlVector, typename TValue>
+  template<typename TConfig, typename TGlVector, typename TValue>
+  inline void
+  _estBiallelicGTFreq(TConfig const& c, TGlVector const& glVector, TValue (&mleGTFreq)[3]) {
+    _estBiallelicGTFreq<typename SumTraits<TValue>::TSum>(c, glVector, mleGTFreq);
+  }
+
+
+  template<typename TSum, typename TGlVector, typename TValue>
   inline void
   _estBiallelicFIC(TGlVector const& glVector, TValue const (&hweAF)[2], TValue& F) {
     if (!glVector.empty()) {
       TValue hweGT[3];
-      hweGT[0] = hweAF[0] * hweAF[0];
-      hweGT[1] = 2 * hweAF[0] * hweAF[1];
-      hweGT[2] = hweAF[1] * hweAF[1];
-      TValue sumGLHet = 0;
-      TValue denominator = 0;
-      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG) {
-	sumGLHet += ((itG->at(1) * hweGT[1]) / (itG->at(0) * hweGT[0] + itG->at(1) * hweGT[1] + itG->at(2) * hweGT[2]));
-	denominator += hweGT[1];
-      }
-      F = 1 - sumGLHet/denominator;
+      _hweGenotypes(hweAF, hweGT);
+      TSum sumGLHet;
+      TSum denominator;
+      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	_ficStep(*itG, hweGT, sumGLHet, denominator);
+      _ficFinal(sumGLHet, denominator, F);
     }
   }
 
 
   template<typename TGlVector, typename TValue>
   inline void
+  _estBiallelicFIC(TGlVector const& glVector, TValue const (&hweAF)[2], TValue& F) {
+    _estBiallelicFIC<typename SumTraits<TValue>::TSum>(glVector, hweAF, F);
+  }
+
+
+  template<typename TSum, typename TGlVector, typename TValue>
+  inline void
   _estBiallelicRSQ(TGlVector const& glVector, TValue const (&hweAF)[2], TValue& rsq) {
     // observed/expected dosage variance calculated as var(dosage)/(2*p*q)
     // MaCH-Rsq threshold is >0.3
     if (!glVector.empty()) {
       TValue hweGT[3];
-      hweGT[0] = hweAF[0] * hweAF[0];
-      hweGT[1] = 2 * hweAF[0] * hweAF[1];  // Expected variance explained by a SNP
-      hweGT[2] = hweAF[1] * hweAF[1];
-      TValue post[3];
-      TValue p = 0;
-      TValue sumD = 0;
-      TValue sumD2 = 0;
-      TValue numSample = glVector.size();
-      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG) {
-	post[0] = itG->at(0) * hweGT[0];
-	post[1] = itG->at(1) * hweGT[1];
-	post[2] = itG->at(2) * hweGT[2];
-	p = post[0] + post[1] + post[2];
-	post[0] /= p;
-	post[1] /= p;
-	post[2] /= p;
-	sumD += (post[1] + 2 * post[0]);  // genetic variance 2 * post[0] + 1 * post[1] + 0 * post[2]
-	sumD2 += (post[1] + 2 * post[0]) * (post[1] + 2 * post[0]);
-      }
-      TValue meanD = sumD/numSample;
-      sumD2 = (sumD2 -numSample * meanD * meanD);
-      if (sumD2 < 0) sumD2 = 0;
-      sumD2 /= (numSample - 1);
-      rsq = sumD2 / hweGT[1];
+      _hweGenotypes(hweAF, hweGT);  // hweGT[1]: Expected variance explained by a SNP
+      TSum sumDosage;
+      TSum sumDosage2;
+      std::size_t numValid = 0;
+      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	if (_rsqStep(*itG, hweGT, sumDosage, sumDosage2)) ++numValid;
+      _rsqFinal(sumDosage, sumDosage2, numValid, hweGT, rsq);
     }
   }
 
   template<typename TGlVector, typename TValue>
   inline void
+  _estBiallelicRSQ(TGlVector const& glVector, TValue const (&hweAF)[2], TValue& rsq) {
+    _estBiallelicRSQ<typename SumTraits<TValue>::TSum>(glVector, hweAF, rsq);
+  }
+
+  template<typename TSum, typename TGlVector, typename TValue>
+  inline void
   _estBiallelicHWE_LRT(TGlVector const& glVector, TValue const (&hweAF)[2], TValue const (&mleGTFreq)[3], TValue& pvalue) {
     if (!glVector.empty()) {
       TValue hweGT[3];
-      hweGT[0] = hweAF[0] * hweAF[0];
-      hweGT[1] = 2 * hweAF[0] * hweAF[1];
-      hweGT[2] = hweAF[1] * hweAF[1];
-      TValue null = 0;
-      TValue alt = 0;
-      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG) {
-	null += std::log(itG->at(0) * hweGT[0] + itG->at(1) * hweGT[1] + itG->at(2) * hweGT[2]);
-	alt += std::log(itG->at(0) * mleGTFreq[0] + itG->at(1) * mleGTFreq[1] + itG->at(2) * mleGTFreq[2]);
+      _hweGenotypes(hweAF, hweGT);
+      TSum null;
+      TSum alt;
+      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	_hweStep(*itG, hweGT, mleGTFreq, null, alt);
+      _hweFinal(null, alt, pvalue);
+    }
+  }
+
+  template<typename TGlVector, typename TValue>
+  inline void
+  _estBiallelicHWE_LRT(TGlVector const& glVector, TValue const (&hweAF)[2], TValue const (&mleGTFreq)[3], TValue& pvalue) {
+    _estBiallelicHWE_LRT<typename SumTraits<TValue>::TSum>(glVector, hweAF, mleGTFreq, pvalue);
+  }
+
+  // All site-level estimates of a biallelic site
+  template<typename TSum, typename TConfig, typename TGlVector, typename TValue>
+  inline void
+  _estBiallelic(TConfig const& c, TGlVector const& glVector, BiallelicEstimate<TValue>& est) {
+    est.hweAF[0] = (TValue) 0.5;
+    est.hweAF[1] = (TValue) 0.5;
+    _estBiallelicAF<TSum>(c, glVector, est.hweAF);
+    est.mleGTFreq[0] = 0;
+    est.mleGTFreq[1] = 0;
+    est.mleGTFreq[2] = 0;
+    _estBiallelicGTFreq<TSum>(c, glVector, est.mleGTFreq);
+    est.fic = 0;
+    _estBiallelicFIC<TSum>(glVector, est.hweAF, est.fic);
+    est.rsq = 0;
+    _estBiallelicRSQ<TSum>(glVector, est.hweAF, est.rsq);
+    est.hwepval = 0;
+    _estBiallelicHWE_LRT<TSum>(glVector, est.hweAF, est.mleGTFreq, est.hwepval);
+  }
+
+  // Haploid site (chrY, MT, chrX of males): AF, GFmle and RSQ, FIC and HWE are undefined
+  template<typename TSum, typename TConfig, typename TGlVector, typename TValue>
+  inline void
+  _estHaploid(TConfig const& c, TGlVector const& glVector, BiallelicEstimate<TValue>& est) {
+    est.hweAF[0] = (TValue) 0.5;
+    est.hweAF[1] = (TValue) 0.5;
+    est.fic = 0;
+    est.rsq = 0;
+    est.hwepval = 0;
+    if (!glVector.empty()) {
+      TValue afprior[2];
+      afprior[0] = (TValue) 0.5;
+      afprior[1] = (TValue) 0.5;
+      TValue err = 1;
+      for(std::size_t count = 0; ((err > c.epsilon) && (count<c.maxiter)); ++count) {
+	TSum sumAF[2];
+	std::size_t numGl = 0;
+	for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	  if (_afStep(*itG, afprior, sumAF)) ++numGl;
+	if (!numGl) break;
+	err = _afUpdate(sumAF, numGl, afprior, est.hweAF);
       }
-      TValue lrts = -2 * (null - alt);
-      if (lrts < 0) lrts = 0;
-      boost::math::chi_squared chisqDist(1);
-      pvalue = boost::math::cdf(complement(chisqDist, lrts));  // Probability that the variable takes a value > lrts
+      TSum sumDosage;
+      TSum sumDosage2;
+      std::size_t numValid = 0;
+      for(typename TGlVector::const_iterator itG = glVector.begin(); itG !=glVector.end();++itG)
+	if (_rsqStep(*itG, est.hweAF, sumDosage, sumDosage2)) ++numValid;
+      _rsqFinal(sumDosage, sumDosage2, numValid, est.hweAF, est.rsq);
+    }
+    est.mleGTFreq[0] = est.hweAF[0];
+    est.mleGTFreq[1] = est.hweAF[1];
+    est.mleGTFreq[2] = 0;
+  }
+
+  template<typename TSum, typename TConfig, typename TValue>
+  inline void
+  _estBiallelic(TConfig const& c, std::vector<boost::array<TValue, 2> > const& glVector, BiallelicEstimate<TValue>& est) {
+    _estHaploid<TSum>(c, glVector, est);
+  }
+
+  template<typename TConfig, typename TGlVector, typename TValue>
+  inline void
+  _estBiallelic(TConfig const& c, TGlVector const& glVector, BiallelicEstimate<TValue>& est) {
+    _estBiallelic<typename SumTraits<TValue>::TSum>(c, glVector, est);
+  }
+
+  // Phred-scaled error probability of the most likely genotype, capped at 99 and rounded to one decimal
+  template<typename TGLs, typename TAccuracyType>
+  inline float
+  _sampleGQ(TGLs const& lik, TAccuracyType const (&mleGTFreq)[3]) {
+    TGLs pp;
+    int bestGlIndex = 0;
+    for(std::size_t k = 0; k < lik.size(); ++k) {
+      pp[k] = lik[k] * mleGTFreq[k];
+      if (lik[k] > lik[bestGlIndex]) bestGlIndex = k;
+    }
+    // Error probability from the other genotypes, 1 - posterior cancels in float for confident genotypes
+    TAccuracyType sumPP = 0;
+    TAccuracyType errPP = 0;
+    for(std::size_t k = 0; k < lik.size(); ++k) {
+      sumPP += pp[k];
+      if ((int) k != bestGlIndex) errPP += pp[k];
     }
+    if (!(sumPP > 0)) return 0;
+    if (!(errPP > 0)) return 99;
+    TAccuracyType sample_gq = (TAccuracyType) -10.0 * std::log10(errPP / sumPP);
+    if (sample_gq > 99) sample_gq = 99;
+    return ((float) boost::math::iround(sample_gq * 10)) / ((float) 10.0);
   }
-      
 
 }
 
@@ -0,0 +1,216 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <vector>
+#include "arfer.h"
+
+namespace vcfaid
+{
+
+  // GLs of a block of sites, tiled by sample so that one tile of all sites fits into the cache
+  template<typename TGLs>
+  struct SiteBatch {
+    std::size_t tileSize;
+    std::size_t ntiles;
+    std::vector<std::size_t> nsamples;
+    std::vector<std::size_t> offset;  // Tile t of site s is gls[offset[t * nsites + s], offset[t * nsites + s + 1])
+    std::vector<TGLs> gls;
+
+    SiteBatch() : tileSize(0), ntiles(0) {}
+
+    inline std::size_t nsites() const { return nsamples.size(); }
+  };
+
+  // EM state of one site in a batch
+  template<typename TSum, typename TValue>
+  struct BatchEM {
+    bool activeAF;
+    bool activeGF;
+    std::size_t countAF;
+    std::size_t countGF;
+    std::size_t numAF;
+    std::size_t numGF;
+    TValue errAF;
+    TValue errGF;
+    TValue afprior[2];
+    TValue gtprior[3];
+    TValue gfprior[3];
+    TSum sumAF[2];
+    TSum sumGT[3];
+  };
+
+  // Post-EM sums of one site in a batch
+  template<typename TSum, typename TValue>
+  struct BatchStats {
+    std::size_t numValid;
+    TValue hweGT[3];
+    TSum sumGLHet;
+    TSum denominator;
+    TSum sumDosage;
+    TSum sumDosage2;
+    TSum null;
+    TSum alt;
+
+    BatchStats() : numValid(0) {}
+  };
+
+  template<typename TGlVector, typename TGLs>
+  inline void
+  _tileBatch(std::vector<TGlVector> const& sites, std::size_t const cacheBytes, SiteBatch<TGLs>& batch) {
+    std::size_t nsites = sites.size();
+    std::size_t maxSamples = 0;
+    std::size_t total = 0;
+    batch.nsamples.resize(nsites);
+    for(std::size_t s = 0; s < nsites; ++s) {
+      batch.nsamples[s] = sites[s].size();
+      maxSamples = std::max(maxSamples, sites[s].size());
+      total += sites[s].size();
+    }
+    batch.tileSize = std::max((std::size_t) 64, cacheBytes / (std::max(nsites, (std::size_t) 1) * sizeof(TGLs)));
+    batch.ntiles = (maxSamples + batch.tileSize - 1) / batch.tileSize;
+    batch.offset.resize(batch.ntiles * nsites + 1);
+    batch.gls.resize(total);
+    std::size_t idx = 0;
+    for(std::size_t t = 0; t < batch.ntiles; ++t) {
+      std::size_t tStart = t * batch.tileSize;
+      for(std::size_t s = 0; s < nsites; ++s) {
+	batch.offset[t * nsites + s] = idx;
+	std::size_t tEnd = std::min(tStart + batch.tileSize, sites[s].size());
+	for(std::size_t i = tStart; i < tEnd; ++i, ++idx) batch.gls[idx] = sites[s][i];
+      }
+    }
+    batch.offset[batch.ntiles * nsites] = idx;
+  }
+
+  // All site-level estimates for a batch of sites. Both EMs of all sites advance together in one sweep
+  // over each sample tile, converged sites drop out. Every site sums its samples in the same order as
+  // _estBiallelic, so the results are identical to the single-site path.
+  template<typename TSum, typename TConfig, typename TGLs, typename TValue>
+  inline void
+  _estBiallelicBatch(TConfig const& c, SiteBatch<TGLs> const& batch, std::vector<BiallelicEstimate<TValue> >& est) {
+    typedef BatchEM<TSum, TValue> TBatchEM;
+    std::size_t nsites = batch.nsites();
+    est.resize(nsites);
+    std::vector<TBatchEM> em(nsites);
+    bool anyActive = false;
+    for(std::size_t s = 0; s < nsites; ++s) {
+      est[s].hweAF[0] = (TValue) 0.5;
+      est[s].hweAF[1] = (TValue) 0.5;
+      est[s].mleGTFreq[0] = 0;
+      est[s].mleGTFreq[1] = 0;
+      est[s].mleGTFreq[2] = 0;
+      est[s].fic = 0;
+      est[s].rsq = 0;
+      est[s].hwepval = 0;
+      em[s].errAF = 1;
+      em[s].errGF = 1;
+      em[s].countAF = 0;
+      em[s].countGF = 0;
+      em[s].activeAF = ((batch.nsamples[s] > 0) && (em[s].errAF > c.epsilon) && (em[s].countAF < c.maxiter));
+      em[s].activeGF = em[s].activeAF;
+      em[s].afprior[0] = (TValue) 0.5;
+      em[s].afprior[1] = (TValue) 0.5;
+      for(int k = 0; k < 3; ++k) em[s].gfprior[k] = (TValue) 1.0 / (TValue) 3.0;
+      anyActive |= em[s].activeAF;
+    }
+
+    // EM iterations
+    while (anyActive) {
+      for(std::size_t s = 0; s < nsites; ++s) {
+	if (em[s].activeAF) {
+	  _hweGenotypes(em[s].afprior, em[s].gtprior);
+	  em[s].sumAF[0] = TSum();
+	  em[s].sumAF[1] = TSum();
+	  em[s].numAF = 0;
+	}
+	if (em[s].activeGF) {
+	  for(int k = 0; k < 3; ++k) em[s].sumGT[k] = TSum();
+	  em[s].numGF = 0;
+	}
+      }
+      for(std::size_t t = 0; t < batch.ntiles; ++t) {
+	for(std::size_t s = 0; s < nsites; ++s) {
+	  TBatchEM& st = em[s];
+	  if ((!st.activeAF) && (!st.activeGF)) continue;
+	  for(std::size_t i = batch.offset[t * nsites + s]; i < batch.offset[t * nsites + s + 1]; ++i) {
+	    if ((st.activeAF) && (_afStep(batch.gls[i], st.gtprior, st.sumAF))) ++st.numAF;
+	    if ((st.activeGF) && (_gtFreqStep(batch.gls[i], st.gfprior, st.sumGT))) ++st.numGF;
+	  }
+	}
+      }
+      anyActive = false;
+      for(std::size_t s = 0; s < nsites; ++s) {
+	TBatchEM& st = em[s];
+	if (st.activeAF) {
+	  if (!st.numAF) st.activeAF = false;
+	  else {
+	    st.errAF = _afUpdate(st.sumAF, st.numAF, st.afprior, est[s].hweAF);
+	    ++st.countAF;
+	    st.activeAF = ((st.errAF > c.epsilon) && (st.countAF < c.maxiter));
+	  }
+	}
+	if (st.activeGF) {
+	  if (!st.numGF) st.activeGF = false;
+	  else {
+	    st.errGF = _gtFreqUpdate(st.sumGT, st.numGF, st.gfprior, est[s].mleGTFreq);
+	    ++st.countGF;
+	    st.activeGF = ((st.errGF > c.epsilon) && (st.countGF < c.maxiter));
+	  }
+	}
+	anyActive |= (st.activeAF || st.activeGF);
+      }
+    }
+
+    // FIC, RSQ and HWE in a single sweep
+    std::vector<BatchStats<TSum, TValue> > stats(nsites);
+    for(std::size_t s = 0; s < nsites; ++s) _hweGenotypes(est[s].hweAF, stats[s].hweGT);
+    for(std::size_t t = 0; t < batch.ntiles; ++t) {
+      for(std::size_t s = 0; s < nsites; ++s) {
+	BatchStats<TSum, TValue>& bs = stats[s];
+	for(std::size_t i = batch.offset[t * nsites + s]; i < batch.offset[t * nsites + s + 1]; ++i) {
+	  _ficStep(batch.gls[i], bs.hweGT, bs.sumGLHet, bs.denominator);
+	  if (_rsqStep(batch.gls[i], bs.hweGT, bs.sumDosage, bs.sumDosage2)) ++bs.numValid;
+	  _hweStep(batch.gls[i], bs.hweGT, est[s].mleGTFreq, bs.null, bs.alt);
+	}
+      }
+    }
+    for(std::size_t s = 0; s < nsites; ++s) {
+      if (!batch.nsamples[s]) continue;
+      _ficFinal(stats[s].sumGLHet, stats[s].denominator, est[s].fic);
+      _rsqFinal(stats[s].sumDosage, stats[s].sumDosage2, stats[s].numValid, stats[s].hweGT, est[s].rsq);
+      _hweFinal(stats[s].null, stats[s].alt, est[s].hwepval);
+    }
+  }
+
+  template<typename TConfig, typename TGLs, typename TValue>
+  inline void
+  _estBiallelicBatch(TConfig const& c, SiteBatch<TGLs> const& batch, std::vector<BiallelicEstimate<TValue> >& est) {
+    _estBiallelicBatch<typename SumTraits<TValue>::TSum>(c, batch, est);
+  }
+
+}
+
+#endif
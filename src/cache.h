@@ -0,0 +1,336 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "arfer.h"
+#include "stream.h"
+
+namespace vcfaid
+{
+
+  static const char CACHE_MAGIC[9] = "VCFAIDC1";
+  static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+  static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+  // New entries a worker keeps in memory before they are spilled to a sorted run file
+  static const std::size_t CACHE_RUN_ENTRIES = 65536;
+
+  // EM parameters the cached estimates depend on, a cache written with other parameters is not used
+  struct CacheHeader {
+    char magic[8];
+    uint32_t precision;  // sizeof(TAccuracyType)
+    uint32_t reproducible;
+    uint32_t maxiter;
+    uint32_t reserved;
+    double epsilon;
+    uint64_t nentries;
+  };
+
+  // Site estimates, sorted by position, hash: likelihoods and GTs of all samples
+  struct CacheEntry {
+    int32_t rid;
+    int32_t ploidy;
+    int64_t pos;
+    uint64_t hash;
+    double hweAF[2];
+    double mleGTFreq[3];
+    double fic;
+    double rsq;
+    double hwepval;
+  };
+
+  inline bool
+  operator<(CacheEntry const& a, CacheEntry const& b) {
+    if (a.rid != b.rid) return (a.rid < b.rid);
+    if (a.pos != b.pos) return (a.pos < b.pos);
+    return (a.hash < b.hash);
+  }
+
+  inline bool
+  _sameKey(CacheEntry const& a, CacheEntry const& b) {
+    return ((a.rid == b.rid) && (a.pos == b.pos) && (a.hash == b.hash));
+  }
+
+  // Memory-mapped cache file of previous runs, new entries of this run are spilled to sorted run files next to it
+  struct ResultCache {
+    CacheHeader header;
+    boost::iostreams::mapped_file_source file;
+    CacheEntry const* entries;
+    uint64_t nentries;
+    std::atomic<uint64_t> nruns;
+
+    ResultCache() : entries(NULL), nentries(0), nruns(0) {}
+  };
+
+  // FNV-1a
+  inline uint64_t
+  _fnv1a(void const* data, std::size_t const len, uint64_t h) {
+    unsigned char const* p = (unsigned char const*) data;
+    for(std::size_t i = 0; i < len; ++i) {
+      h ^= p[i];
+      h *= FNV_PRIME;
+    }
+    return h;
+  }
+
+  // Cache key of a record: GTs and likelihoods of all samples in the layout of the unpacked arrays
+  template<typename TRaw>
+  inline uint64_t
+  _siteHash(int32_t const ploidy, int32_t const nsamples, TRaw const* gl, int32_t const* gt) {
+    uint64_t h = _fnv1a(&ploidy, sizeof(int32_t), FNV_OFFSET);
+    h = _fnv1a(gt, nsamples * ploidy * sizeof(int32_t), h);
+    return _fnv1a(gl, nsamples * (ploidy + 1) * sizeof(TRaw), h);
+  }
+
+  // Same key from the packed FORMAT fields of the memory-bounded mode
+  template<int P, typename TRaw>
+  inline uint64_t
+  _packedSiteHash(int32_t const nsamples, bcf_fmt_t const* fgl, bcf_fmt_t const* fgt) {
+    int32_t ploidy = P;
+    uint64_t h = _fnv1a(&ploidy, sizeof(int32_t), FNV_OFFSET);
+    for(int32_t i = 0; i < nsamples; ++i) {
+      for(int j = 0; j < P; ++j) {
+	int32_t v;
+	_packedValue(fgt, i, j, v);
+	h = _fnv1a(&v, sizeof(int32_t), h);
+      }
+    }
+    for(int32_t i = 0; i < nsamples; ++i) {
+      for(int j = 0; j < P + 1; ++j) {
+	TRaw v;
+	_packedValue(fgl, i, j, v);
+	h = _fnv1a(&v, sizeof(TRaw), h);
+      }
+    }
+    return h;
+  }
+
+  template<typename TConfig>
+  inline void
+  _cacheHeader(TConfig const& c, uint32_t const precision, CacheHeader& header) {
+    std::memset(&header, 0, sizeof(CacheHeader));
+    std::memcpy(header.magic, CACHE_MAGIC, 8);
+    header.precision = precision;
+    header.reproducible = c.reproducible;
+    header.maxiter = c.maxiter;
+    header.epsilon = c.epsilon;
+  }
+
+  // Map an existing cache file, returns false if there is none or it was written with other EM parameters
+  inline bool
+  _openCache(boost::filesystem::path const& cachefile, CacheHeader const& header, ResultCache& cache) {
+    cache.header = header;
+    cache.entries = NULL;
+    cache.nentries = 0;
+    if (cache.file.is_open()) cache.file.close();
+    if ((!boost::filesystem::exists(cachefile)) || (boost::filesystem::file_size(cachefile) < sizeof(CacheHeader))) return false;
+    cache.file.open(cachefile.string());
+    if (!cache.file.is_open()) return false;
+    CacheHeader fh;
+    std::memcpy(&fh, cache.file.data(), sizeof(CacheHeader));
+    if ((std::memcmp(fh.magic, header.magic, 8) != 0) || (fh.precision != header.precision) || (fh.reproducible != header.reproducible) || (fh.maxiter != header.maxiter) || (fh.epsilon != header.epsilon) || (cache.file.size() != sizeof(CacheHeader) + fh.nentries * sizeof(CacheEntry))) {
+      cache.file.close();
+      return false;
+    }
+    cache.entries = (CacheEntry const*) (cache.file.data() + sizeof(CacheHeader));
+    cache.nentries = fh.nentries;
+    return true;
+  }
+
+  inline CacheEntry const*
+  _findCache(ResultCache const& cache, int32_t const rid, int64_t const pos, uint64_t const hash) {
+    if (!cache.nentries) return NULL;
+    CacheEntry key;
+    key.rid = rid;
+    key.pos = pos;
+    key.hash = hash;
+    CacheEntry const* it = std::lower_bound(cache.entries, cache.entries + cache.nentries, key);
+    if ((it != cache.entries + cache.nentries) && (it->rid == rid) && (it->pos == pos) && (it->hash == hash)) return it;
+    return NULL;
+  }
+
+  template<typename TValue>
+  inline void
+  _toCacheEntry(int32_t const rid, int64_t const pos, uint64_t const hash, int32_t const ploidy, BiallelicEstimate<TValue> const& est, CacheEntry& e) {
+    std::memset(&e, 0, sizeof(CacheEntry));
+    e.rid = rid;
+    e.ploidy = ploidy;
+    e.pos = pos;
+    e.hash = hash;
+    for(int k = 0; k < 2; ++k) e.hweAF[k] = est.hweAF[k];
+    for(int k = 0; k < 3; ++k) e.mleGTFreq[k] = est.mleGTFreq[k];
+    e.fic = est.fic;
+    e.rsq = est.rsq;
+    e.hwepval = est.hwepval;
+  }
+
+  // Exact for float estimates, they are stored as double
+  template<typename TValue>
+  inline void
+  _fromCacheEntry(CacheEntry const& e, BiallelicEstimate<TValue>& est) {
+    for(int k = 0; k < 2; ++k) est.hweAF[k] = e.hweAF[k];
+    for(int k = 0; k < 3; ++k) est.mleGTFreq[k] = e.mleGTFreq[k];
+    est.fic = e.fic;
+    est.rsq = e.rsq;
+    est.hwepval = e.hwepval;
+  }
+
+  // Run files of cachefile, also those left behind by an interrupted run
+  inline std::string
+  _cacheRunPrefix(boost::filesystem::path const& cachefile) {
+    return cachefile.filename().string() + ".run.";
+  }
+
+  inline void
+  _cacheRuns(boost::filesystem::path const& cachefile, std::vector<boost::filesystem::path>& runs) {
+    runs.clear();
+    boost::filesystem::path dir = cachefile.parent_path();
+    if (dir.empty()) dir = ".";
+    if (!boost::filesystem::is_directory(dir)) return;
+    std::string prefix = _cacheRunPrefix(cachefile);
+    for(boost::filesystem::directory_iterator it(dir); it != boost::filesystem::directory_iterator(); ++it) {
+      std::string name = it->path().filename().string();
+      if ((name.compare(0, prefix.size(), prefix) == 0) && (it->path().extension() != ".tmp")) runs.push_back(it->path());
+    }
+    std::sort(runs.begin(), runs.end());
+  }
+
+  // Sort new entries and write them as a run file, the buffer is emptied
+  inline bool
+  _spillCache(boost::filesystem::path const& cachefile, ResultCache& cache, std::vector<CacheEntry>& added) {
+    if (added.empty()) return true;
+    std::sort(added.begin(), added.end());
+    CacheHeader header = cache.header;
+    header.nentries = added.size();
+    boost::filesystem::path runfile(cachefile.string() + ".run." + std::to_string(getpid()) + "." + std::to_string(cache.nruns++));
+    boost::filesystem::path tmpfile(runfile.string() + ".tmp");
+    std::ofstream ofile(tmpfile.string().c_str(), std::ios::binary);
+    if (!ofile.is_open()) return false;
+    ofile.write((char const*) &header, sizeof(CacheHeader));
+    ofile.write((char const*) &added[0], added.size() * sizeof(CacheEntry));
+    ofile.close();
+    added.clear();
+    if (ofile.fail()) return false;
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmpfile, runfile, ec);
+    return !ec;
+  }
+
+  // Sequential reader of a run file
+  struct CacheRunReader {
+    std::ifstream in;
+    uint64_t remaining;
+    CacheEntry entry;
+
+    CacheRunReader() : remaining(0) {}
+
+    inline bool
+    open(boost::filesystem::path const& runfile, CacheHeader const& header) {
+      in.open(runfile.string().c_str(), std::ios::binary);
+      if (!in.is_open()) return false;
+      CacheHeader fh;
+      in.read((char*) &fh, sizeof(CacheHeader));
+      if ((!in) || (std::memcmp(&fh, &header, offsetof(CacheHeader, nentries)) != 0) || (boost::filesystem::file_size(runfile) != sizeof(CacheHeader) + fh.nentries * sizeof(CacheEntry))) return false;
+      remaining = fh.nentries;
+      return true;
+    }
+
+    inline bool
+    next() {
+      if (!remaining) return false;
+      --remaining;
+      in.read((char*) &entry, sizeof(CacheEntry));
+      return !in.fail();
+    }
+  };
+
+  // Stream-merge the mapped cache and all run files written with the same EM parameters into a new cache file.
+  // Only one entry per source is in memory; runs with other parameters are dropped.
+  inline bool
+  _mergeCache(boost::filesystem::path const& cachefile, ResultCache& cache) {
+    std::vector<boost::filesystem::path> runs;
+    _cacheRuns(cachefile, runs);
+    if (runs.empty()) return true;
+    std::vector<CacheRunReader> readers(runs.size());
+    typedef std::pair<CacheEntry, std::size_t> THead;  // Source 0: mapped cache, k > 0: run k - 1
+    auto later = [](THead const& a, THead const& b) { return ((b.first < a.first) || ((!(a.first < b.first)) && (a.second > b.second))); };
+    std::priority_queue<THead, std::vector<THead>, decltype(later)> heads(later);
+    if (cache.nentries) heads.push(THead(cache.entries[0], 0));
+    for(std::size_t k = 0; k < runs.size(); ++k)
+      if ((readers[k].open(runs[k], cache.header)) && (readers[k].next())) heads.push(THead(readers[k].entry, k + 1));
+
+    CacheHeader header = cache.header;
+    header.nentries = 0;
+    boost::filesystem::path tmpfile(cachefile.string() + ".tmp");
+    std::ofstream ofile(tmpfile.string().c_str(), std::ios::binary);
+    if (!ofile.is_open()) return false;
+    ofile.write((char const*) &header, sizeof(CacheHeader));
+    uint64_t idx = 0;
+    CacheEntry last;
+    while (!heads.empty()) {
+      THead h = heads.top();
+      heads.pop();
+      if ((!header.nentries) || (!_sameKey(last, h.first))) {
+	ofile.write((char const*) &h.first, sizeof(CacheEntry));
+	last = h.first;
+	++header.nentries;
+      }
+      if (h.second == 0) {
+	if (++idx < cache.nentries) heads.push(THead(cache.entries[idx], 0));
+      } else if (readers[h.second - 1].next()) heads.push(THead(readers[h.second - 1].entry, h.second));
+    }
+    ofile.seekp(0);
+    ofile.write((char const*) &header, sizeof(CacheHeader));
+    ofile.close();
+    if (ofile.fail()) return false;
+
+    // Replace the cache file, runs are removed once they are part of it
+    readers.clear();
+    if (cache.file.is_open()) cache.file.close();
+    cache.entries = NULL;
+    cache.nentries = 0;
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmpfile, cachefile, ec);
+    if (ec) return false;
+    for(std::size_t k = 0; k < runs.size(); ++k) boost::filesystem::remove(runs[k], ec);
+    return true;
+  }
+
+}
+
+#endif
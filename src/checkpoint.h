@@ -0,0 +1,139 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <htslib/vcf.h>
+#include <htslib/hfile.h>
+
+#include "qc.h"
+
+namespace vcfaid
+{
+
+  // Progress of a run at the last flushed output block
+  struct Checkpoint {
+    bool sitesOnly;
+    std::string options;  // Options that change the output records
+    uint64_t insize;
+    uint64_t nrec;
+    uint64_t nsites;
+    int64_t inoffset;
+    int64_t outoffset;
+    int32_t rid;
+    int64_t pos;
+    std::vector<SampleQC> qc;
+
+    Checkpoint() : sitesOnly(false), insize(0), nrec(0), nsites(0), inoffset(0), outoffset(0), rid(-1), pos(-1) {}
+  };
+
+  // Options a resumed run has to share with the checkpointed run, so that all records are processed the same way
+  template<typename TConfig>
+  inline std::string
+  _checkpointOptions(TConfig const& c) {
+    std::ostringstream s;
+    s << std::setprecision(17) << "g=" << c.gqthreshold << ",f=" << c.singlePrecision << ",x=" << c.reproducible << ",e=" << c.epsilon << ",m=" << c.maxiter << ",O=" << c.outputType << ",l=" << c.compressionLevel;
+    return s.str();
+  }
+
+  inline boost::filesystem::path
+  _checkpointFile(boost::filesystem::path const& outfile) {
+    return boost::filesystem::path(outfile.string() + ".ckpt");
+  }
+
+  // Flush pending output to a BGZF block boundary, returns the compressed file offset or -1
+  inline int64_t
+  _flushBlock(htsFile* fp) {
+    BGZF* bgzfp = hts_get_bgzfp(fp);
+    if (bgzfp == NULL) return -1;
+    if (bgzf_flush(bgzfp) != 0) return -1;
+    if (hflush(bgzfp->fp) != 0) return -1;
+    return bgzf_tell(bgzfp) >> 16;
+  }
+
+  template<typename TCheckpoint>
+  inline bool
+  _writeCheckpoint(boost::filesystem::path const& outfile, TCheckpoint const& ck) {
+    // Write to a temporary file and rename, a preempted job never leaves a truncated checkpoint
+    boost::filesystem::path ckfile = _checkpointFile(outfile);
+    boost::filesystem::path tmpfile(ckfile.string() + ".tmp");
+    std::ofstream ofile(tmpfile.string().c_str());
+    if (!ofile.is_open()) return false;
+    ofile << "sitesOnly " << ck.sitesOnly << std::endl;
+    ofile << "options " << ck.options << std::endl;
+    ofile << "insize " << ck.insize << std::endl;
+    ofile << "nrec " << ck.nrec << std::endl;
+    ofile << "nsites " << ck.nsites << std::endl;
+    ofile << "inoffset " << ck.inoffset << std::endl;
+    ofile << "outoffset " << ck.outoffset << std::endl;
+    ofile << "rid " << ck.rid << std::endl;
+    ofile << "pos " << ck.pos << std::endl;
+    ofile << "qc " << ck.qc.size() << std::endl;
+    for(std::size_t i = 0; i < ck.qc.size(); ++i) ofile << ck.qc[i].ncalled << ' ' << ck.qc[i].nmasked << ' ' << ck.qc[i].nhet << ' ' << ck.qc[i].nhomalt << ' ' << ck.qc[i].sumGQ << ' ' << ck.qc[i].obsHet << ' ' << ck.qc[i].expHet << std::endl;
+    ofile.close();
+    if (ofile.fail()) return false;
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmpfile, ckfile, ec);
+    return !ec;
+  }
+
+  template<typename TCheckpoint>
+  inline bool
+  _readCheckpoint(boost::filesystem::path const& outfile, TCheckpoint& ck) {
+    std::ifstream ifile(_checkpointFile(outfile).string().c_str());
+    if (!ifile.is_open()) return false;
+    uint32_t nkeys = 0;
+    std::string key;
+    while (ifile >> key) {
+      if (key == "sitesOnly") ifile >> ck.sitesOnly;
+      else if (key == "options") ifile >> ck.options;
+      else if (key == "insize") ifile >> ck.insize;
+      else if (key == "nrec") ifile >> ck.nrec;
+      else if (key == "nsites") ifile >> ck.nsites;
+      else if (key == "inoffset") ifile >> ck.inoffset;
+      else if (key == "outoffset") ifile >> ck.outoffset;
+      else if (key == "rid") ifile >> ck.rid;
+      else if (key == "pos") ifile >> ck.pos;
+      else if (key == "qc") {
+	std::size_t nsamples = 0;
+	ifile >> nsamples;
+	ck.qc.resize(nsamples);
+	for(std::size_t i = 0; i < nsamples; ++i) ifile >> ck.qc[i].ncalled >> ck.qc[i].nmasked >> ck.qc[i].nhet >> ck.qc[i].nhomalt >> ck.qc[i].sumGQ >> ck.qc[i].obsHet >> ck.qc[i].expHet;
+      }
+      else return false;
+      if (ifile.fail()) return false;
+      ++nkeys;
+    }
+    return (nkeys == 10);
+  }
+
+}
+
+#endif
@@ -26,6 +26,8 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <map>
+#include <sys/resource.h>
 
 #define BOOST_DISABLE_ASSERTS
 #include <boost/program_options/cmdline.hpp>
@@ -35,25 +37,655 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/math/special_functions/round.hpp>
+#include <boost/array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/progress.hpp>
 #include <htslib/sam.h>
 #include <htslib/vcf.h>
 
 #include "arfer.h"
+#include "batch.h"
 #include "gq.h"
+#include "checkpoint.h"
+#include "qc.h"
+#include "stream.h"
+#include "scheduler.h"
+#include "cache.h"
+#include "ingest.h"
 
 using namespace vcfaid;
 
 struct Config {
+  bool sitesOnly;
+  bool resume;
+  bool singlePrecision;
+  bool validate;
+  bool reproducible;
+  bool qc;
+  bool cache;
   uint32_t maxiter;
+  uint32_t checkpoint;
+  uint32_t batch;
+  uint32_t threads;
+  uint32_t ioThreads;
+  uint64_t maxMemory;
+  bool index;
+  char outputType;
+  int32_t compressionLevel;
+  std::size_t tileBytes;
   float gqthreshold;
   double epsilon;
   boost::filesystem::path outfile;
+  boost::filesystem::path qcfile;
+  boost::filesystem::path cachefile;
   boost::filesystem::path vcffile;
 };
 
 
+// Max. deviation of the single-precision from the double-precision kernels
+struct PrecisionCheck {
+  uint64_t nsites;
+  uint64_t ngq;
+  uint64_t nmask;
+  double maxAF;
+  double maxGF;
+  double maxGQ;
+
+  PrecisionCheck() : nsites(0), ngq(0), nmask(0), maxAF(0), maxGF(0), maxGQ(0) {}
+};
+
+
+// Genotype data of a record, TRaw is the GL (float) or PL (int32_t) encoding
+template<typename TRaw>
+struct RecordData {
+  bool biallelic;
+  int32_t ploidy;  // GT values per sample
+  int ngl;
+  TRaw* gl;
+  int ngt;
+  int32_t* gt;
+  uint32_t ac[2];
+
+  RecordData() : biallelic(false), ploidy(0), ngl(0), gl(NULL), ngt(0), gt(NULL) {
+    ac[0] = 0;
+    ac[1] = 0;
+  }
+};
+
+
+template<int P>
+inline void
+_alleleCounts(int32_t const nsamples, int32_t const* gt, uint32_t (&ac)[2]) {
+  ac[0] = 0;
+  ac[1] = 0;
+  for (int i = 0; i < nsamples; ++i) {
+    if (_calledGT<P>(gt + i * P)) {
+      int32_t na = 0;
+      int32_t nalt = 0;
+      _countAlleles<P>(gt + i * P, na, nalt);
+      ac[0] += na - nalt;
+      ac[1] += nalt;
+    }
+  }
+}
+
+template<int P, typename TConfig, typename TRaw>
+inline void
+_comparePrecision(TConfig const& c, int32_t const nsamples, TRaw const* gl, int32_t const* gt, PrecisionCheck& check) {
+  std::vector<boost::array<double, P + 1> > dsite;
+  _siteLikelihoods<P>(nsamples, gl, gt, dsite);
+  BiallelicEstimate<double> dest;
+  _estBiallelic(c, dsite, dest);
+  std::vector<boost::array<float, P + 1> > fsite;
+  _siteLikelihoods<P>(nsamples, gl, gt, fsite);
+  BiallelicEstimate<float> fest;
+  _estBiallelic(c, fsite, fest);
+  ++check.nsites;
+  check.maxAF = std::max(check.maxAF, std::abs(dest.hweAF[1] - (double) fest.hweAF[1]));
+  for(int k = 0; k < P + 1; k++) check.maxGF = std::max(check.maxGF, std::abs(dest.mleGTFreq[k] - (double) fest.mleGTFreq[k]));
+  for (std::size_t i = 0; i < dsite.size(); ++i) {
+    float dgq = _sampleGQ(dsite[i], dest.mleGTFreq);
+    float fgq = _sampleGQ(fsite[i], fest.mleGTFreq);
+    ++check.ngq;
+    check.maxGQ = std::max(check.maxGQ, (double) std::abs(dgq - fgq));
+    if ((dgq < c.gqthreshold) != (fgq < c.gqthreshold)) ++check.nmask;
+  }
+}
+
+// TGT: unpacked (int32_t*) or packed (PackedGT) genotypes, gqval: buffer for all samples
+template<int P, typename TConfig, typename TGT, typename TGlVector, typename TAccuracyType>
+inline void
+_annotateRecord(TConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, bcf1_t* rec, TGT const& gt, uint32_t const (&ac)[2], TGlVector const& glVector, BiallelicEstimate<TAccuracyType> const& est, std::vector<SampleQC>& qc, float* gqval) {
+  float afest = est.hweAF[1];
+  _remove_info_tag(hdr_out, rec, "AFmle");
+  bcf_update_info_float(hdr_out, rec, "AFmle", &afest, 1);
+  int32_t acest = boost::math::iround(est.hweAF[1] * (ac[0] + ac[1]));
+  _remove_info_tag(hdr_out, rec, "ACmle");
+  bcf_update_info_int32(hdr_out, rec, "ACmle", &acest, 1);
+  float gfmle[3];
+  gfmle[0] = est.mleGTFreq[0];
+  gfmle[1] = est.mleGTFreq[1];
+  gfmle[2] = est.mleGTFreq[2];
+  _remove_info_tag(hdr_out, rec, "GFmle");
+  bcf_update_info_float(hdr_out, rec, "GFmle", &gfmle, P + 1);
+  float fic = est.fic;
+  _remove_info_tag(hdr_out, rec, "FIC");
+  if (P == 2) bcf_update_info_float(hdr_out, rec, "FIC", &fic, 1);
+  float rsqfloat = est.rsq;
+  _remove_info_tag(hdr_out, rec, "RSQ");
+  bcf_update_info_float(hdr_out, rec, "RSQ", &rsqfloat, 1);
+  float hwepval = est.hwepval;
+  _remove_info_tag(hdr_out, rec, "HWEpval");
+  if (P == 2) bcf_update_info_float(hdr_out, rec, "HWEpval", &hwepval, 1);
+
+  // Sample GQs are also needed for the QC report of a sites-only run
+  if ((!c.sitesOnly) || (c.qc)) {
+    typename TGlVector::const_iterator itG = glVector.begin();
+    int32_t gtbuf[P];
+    for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
+      int32_t* sgt = _sampleGT<P>(gt, i, gtbuf);
+      if (_calledGT<P>(sgt)) {
+	gqval[i] = _sampleGQ(*itG, est.mleGTFreq);
+	bool masked = (gqval[i] < c.gqthreshold);
+	if (c.qc) _sampleQC<P>(*itG, sgt, gqval[i], masked, est.hweAF, qc[i]);
+	++itG;
+	
+	// Unset GTs
+	if (masked) _maskSampleGT<P>(gt, i);
+      } else {
+	bcf_float_set_missing(gqval[i]);
+      }
+    }
+    if (!c.sitesOnly) {
+      _updateGenotypes<P>(hdr_out, rec, gt, bcf_hdr_nsamples(hdr));
+      _remove_format_tag(hdr_out, rec, "GQ");
+      bcf_update_format_float(hdr_out, rec, "GQ", gqval, bcf_hdr_nsamples(hdr));
+    }
+  }
+
+  // Sites-only output, drop all genotypes
+  if (c.sitesOnly) bcf_subset(hdr_out, rec, 0, 0);
+}
+
+template<typename TConfig, typename TRaw>
+inline void
+_decodeRecord(TConfig const& c, bcf_hdr_t* hdr, bcf1_t* rec, RecordData<TRaw>& d) {
+  if (c.sitesOnly) bcf_unpack(rec, BCF_UN_SHR);
+  else bcf_unpack(rec, BCF_UN_ALL);
+  d.biallelic = (rec->n_allele == 2);
+  if (!d.biallelic) return;
+
+  // Haploid (1 GT, 2 likelihoods) or diploid (2 GTs, 3 likelihoods) records
+  int32_t nsamples = bcf_hdr_nsamples(hdr);
+  int32_t ngt = bcf_get_format_int32(hdr, rec, "GT", &d.gt, &d.ngt);
+  int32_t ngl = bcf_get_format_values(hdr, rec, Encoding<TRaw>::tag(), (void**) &d.gl, &d.ngl, Encoding<TRaw>::type);
+  d.ploidy = ((nsamples) && (ngt > 0)) ? ngt / nsamples : 0;
+  if ((ngt < 0) || (ngl < 0) || (!(((d.ploidy == 1) && (ngl == 2 * nsamples)) || ((d.ploidy == 2) && (ngl == 3 * nsamples))))) {
+    d.biallelic = false;
+    return;
+  }
+  if (d.ploidy == 1) _alleleCounts<1>(nsamples, d.gt, d.ac);
+  else _alleleCounts<2>(nsamples, d.gt, d.ac);
+}
+
+// Statistics and buffers of one worker
+struct WorkerState {
+  PrecisionCheck check;
+  MemoryCheck mem;
+  std::vector<SampleQC> qc;
+  std::vector<float> gqval;
+  ResultCache* cache;
+  std::vector<CacheEntry> added;  // New cache entries, spilled to a run file when full
+  uint64_t ncached;
+  uint64_t nadded;
+  bool cacheError;
+
+  WorkerState() : cache(NULL), ncached(0), nadded(0), cacheError(false) {}
+};
+
+template<typename TConfig, typename TAccuracyType>
+inline bool
+_cachedEstimate(TConfig const& c, WorkerState& st, bcf1_t* rec, uint64_t const hash, BiallelicEstimate<TAccuracyType>& est) {
+  if (!c.cache) return false;
+  CacheEntry const* e = _findCache(*st.cache, rec->rid, rec->pos, hash);
+  if (e == NULL) return false;
+  _fromCacheEntry(*e, est);
+  ++st.ncached;
+  return true;
+}
+
+template<typename TConfig, typename TAccuracyType>
+inline void
+_addCacheEntry(TConfig const& c, WorkerState& st, bcf1_t* rec, uint64_t const hash, int32_t const ploidy, BiallelicEstimate<TAccuracyType> const& est) {
+  if (!c.cache) return;
+  st.added.push_back(CacheEntry());
+  _toCacheEntry(rec->rid, rec->pos, hash, ploidy, est, st.added.back());
+  ++st.nadded;
+  if ((st.added.size() >= CACHE_RUN_ENTRIES) && (!_spillCache(c.cachefile, *st.cache, st.added))) st.cacheError = true;
+}
+
+template<typename TAccuracyType, typename TSum, typename TConfig, typename TRaw>
+inline void
+_processBatch(TConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, std::vector<bcf1_t*>& recs, std::vector<RecordData<TRaw> >& data, uint32_t const n, WorkerState& st) {
+  typedef boost::array<TAccuracyType, 3> TGLs;
+  typedef std::vector<TGLs> TGlVector;
+  typedef std::vector<boost::array<TAccuracyType, 2> > THapVector;
+  int32_t nsamples = bcf_hdr_nsamples(hdr);
+
+  // Load sites, haploid sites are estimated one by one
+  std::vector<TGlVector> sites;
+  std::vector<uint32_t> siteRec;
+  std::vector<THapVector> hapSites;
+  std::vector<uint32_t> hapRec;
+  std::vector<uint64_t> hash(n, 0);
+  for(uint32_t i = 0; i < n; ++i) {
+    if (!data[i].biallelic) continue;
+    if (c.cache) hash[i] = _siteHash(data[i].ploidy, nsamples, data[i].gl, data[i].gt);
+    if (data[i].ploidy == 1) {
+      if (c.validate) _comparePrecision<1>(c, nsamples, data[i].gl, data[i].gt, st.check);
+      hapSites.push_back(THapVector());
+      hapRec.push_back(i);
+      _siteLikelihoods<1>(nsamples, data[i].gl, data[i].gt, hapSites.back());
+    } else {
+      if (c.validate) _comparePrecision<2>(c, nsamples, data[i].gl, data[i].gt, st.check);
+      sites.push_back(TGlVector());
+      siteRec.push_back(i);
+      _siteLikelihoods<2>(nsamples, data[i].gl, data[i].gt, sites.back());
+    }
+  }
+
+  // Estimate sites that are not cached
+  std::vector<BiallelicEstimate<TAccuracyType> > est(sites.size());
+  std::vector<uint32_t> todo;
+  for(uint32_t s = 0; s < sites.size(); ++s)
+    if (!_cachedEstimate(c, st, recs[siteRec[s]], hash[siteRec[s]], est[s])) todo.push_back(s);
+  if (c.batch > 1) {
+    std::vector<TGlVector> missed(todo.size());
+    for(uint32_t k = 0; k < todo.size(); ++k) missed[k].swap(sites[todo[k]]);
+    SiteBatch<TGLs> batch;
+    _tileBatch(missed, c.tileBytes, batch);
+    std::vector<BiallelicEstimate<TAccuracyType> > missedEst(todo.size());
+    _estBiallelicBatch<TSum>(c, batch, missedEst);
+    for(uint32_t k = 0; k < todo.size(); ++k) {
+      missed[k].swap(sites[todo[k]]);
+      est[todo[k]] = missedEst[k];
+    }
+  } else {
+    for(uint32_t k = 0; k < todo.size(); ++k) _estBiallelic<TSum>(c, sites[todo[k]], est[todo[k]]);
+  }
+  for(uint32_t k = 0; k < todo.size(); ++k) _addCacheEntry(c, st, recs[siteRec[todo[k]]], hash[siteRec[todo[k]]], 2, est[todo[k]]);
+  std::vector<BiallelicEstimate<TAccuracyType> > hapEst(hapSites.size());
+  for(uint32_t h = 0; h < hapSites.size(); ++h) {
+    if (_cachedEstimate(c, st, recs[hapRec[h]], hash[hapRec[h]], hapEst[h])) continue;
+    _estBiallelic<TSum>(c, hapSites[h], hapEst[h]);
+    _addCacheEntry(c, st, recs[hapRec[h]], hash[hapRec[h]], 1, hapEst[h]);
+  }
+
+  // Annotate
+  std::vector<float> gqval(nsamples);
+  uint32_t s = 0;
+  uint32_t h = 0;
+  for(uint32_t i = 0; i < n; ++i) {
+    if (!data[i].biallelic) continue;
+    if (data[i].ploidy == 1) {
+      _annotateRecord<1>(c, hdr, hdr_out, recs[i], data[i].gt, data[i].ac, hapSites[h], hapEst[h], st.qc, &gqval[0]);
+      ++h;
+    } else {
+      _annotateRecord<2>(c, hdr, hdr_out, recs[i], data[i].gt, data[i].ac, sites[s], est[s], st.qc, &gqval[0]);
+      ++s;
+    }
+  }
+}
+
+// Memory-bounded estimation of one site from the packed FORMAT fields. The site is decoded once if all its
+// likelihoods fit into the budget, otherwise sample blocks are decoded again on every EM pass.
+template<int P, typename TAccuracyType, typename TSum, typename TRaw, typename TConfig>
+inline void
+_processBoundedSite(TConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, bcf1_t* rec, bcf_fmt_t* fgl, bcf_fmt_t* fgt, WorkerState& st) {
+  typedef boost::array<TAccuracyType, P + 1> TGLs;
+  typedef StreamedSite<P, TRaw, TGLs> TStreamedSite;
+  int32_t nsamples = bcf_hdr_nsamples(hdr);
+  PackedGT<P> gt(fgt);
+  uint32_t ac[2] = {0, 0};
+  int32_t gtbuf[P];
+  for (int32_t i = 0; i < nsamples; ++i) {
+    int32_t* sgt = _sampleGT<P>(gt, i, gtbuf);
+    if (_calledGT<P>(sgt)) {
+      int32_t na = 0;
+      int32_t nalt = 0;
+      _countAlleles<P>(sgt, na, nalt);
+      ac[0] += na - nalt;
+      ac[1] += nalt;
+    }
+  }
+
+  // Record, GQ and QC buffers are needed in any case
+  uint64_t fixed = rec->shared.m + rec->indiv.m + st.gqval.capacity() * sizeof(float) + st.qc.capacity() * sizeof(SampleQC);
+  uint64_t avail = (st.mem.budget > fixed) ? st.mem.budget - fixed : 0;
+  std::size_t blockSize = std::max((std::size_t) 256, (std::size_t) (std::min(avail, (uint64_t) c.tileBytes) / sizeof(TGLs)));
+  TStreamedSite site(fgl, fgt, nsamples, blockSize);
+  BiallelicEstimate<TAccuracyType> est;
+  uint64_t hash = 0;
+  if (c.cache) hash = _packedSiteHash<P, TRaw>(nsamples, fgl, fgt);
+  bool cached = _cachedEstimate(c, st, rec, hash, est);
+  ++st.mem.nsites;
+  if (site.size() * sizeof(TGLs) <= avail) {
+    std::vector<TGLs> glVector;
+    glVector.reserve(site.size());
+    for(typename TStreamedSite::const_iterator itG = site.begin(); itG != site.end(); ++itG) glVector.push_back(*itG);
+    st.mem.peak = std::max(st.mem.peak, fixed + glVector.capacity() * sizeof(TGLs));
+    if (!cached) _estBiallelic<TSum>(c, glVector, est);
+    _annotateRecord<P>(c, hdr, hdr_out, rec, gt, ac, glVector, est, st.qc, &st.gqval[0]);
+  } else {
+    ++st.mem.nstreamed;
+    st.mem.peak = std::max(st.mem.peak, fixed + site.block.capacity() * sizeof(TGLs));
+    if (!cached) _estBiallelic<TSum>(c, site, est);
+    _annotateRecord<P>(c, hdr, hdr_out, rec, gt, ac, site, est, st.qc, &st.gqval[0]);
+  }
+  if (!cached) _addCacheEntry(c, st, rec, hash, P, est);
+}
+
+// Returns false for records that are not written, like _decodeRecord
+template<typename TAccuracyType, typename TSum, typename TRaw, typename TConfig>
+inline bool
+_processBoundedRecord(TConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, bcf1_t* rec, WorkerState& st) {
+  if (c.sitesOnly) bcf_unpack(rec, BCF_UN_SHR);
+  else bcf_unpack(rec, BCF_UN_ALL);
+  if (rec->n_allele != 2) return false;
+  bcf_fmt_t* fgt = bcf_get_fmt(hdr, rec, "GT");
+  bcf_fmt_t* fgl = bcf_get_fmt(hdr, rec, Encoding<TRaw>::tag());
+  if ((fgt == NULL) || (fgl == NULL) || (fgt->type == BCF_BT_FLOAT) || ((fgl->type == BCF_BT_FLOAT) != (Encoding<TRaw>::type == BCF_HT_REAL))) return false;
+  if ((fgt->n == 1) && (fgl->n == 2)) _processBoundedSite<1, TAccuracyType, TSum, TRaw>(c, hdr, hdr_out, rec, fgl, fgt, st);
+  else if ((fgt->n == 2) && (fgl->n == 3)) _processBoundedSite<2, TAccuracyType, TSum, TRaw>(c, hdr, hdr_out, rec, fgl, fgt, st);
+  else return false;
+  return true;
+}
+
+// Records of one work item
+template<typename TRaw>
+struct RecordBatch {
+  uint64_t seq;
+  uint32_t n;
+  std::vector<bcf1_t*> recs;
+  std::vector<RecordData<TRaw> > data;
+
+  explicit RecordBatch(uint32_t const size) : seq(0), n(0), recs(size), data(size) {
+    for(uint32_t i = 0; i < size; ++i) recs[i] = bcf_init();
+  }
+
+  ~RecordBatch() {
+    for(uint32_t i = 0; i < recs.size(); ++i) {
+      bcf_destroy(recs[i]);
+      if (data[i].gl != NULL) free(data[i].gl);
+      if (data[i].gt != NULL) free(data[i].gt);
+    }
+  }
+};
+
+// Samples whose GTs estimate the minor allele count of a record without INFO/AC and AN
+static const int32_t COST_SAMPLES = 256;
+
+// EM cost of a record: samples times the expected iterations, sites with a low minor allele count converge slowly and may run to maxiter.
+// Runs on the dispatch thread, so it does not decode all samples.
+template<typename TConfig>
+inline uint64_t
+_recordCost(TConfig const& c, bcf_hdr_t* hdr, bcf1_t* rec) {
+  if (rec->n_allele != 2) return 1;
+  int32_t nsamples = bcf_hdr_nsamples(hdr);
+  uint64_t na = 0;
+  uint64_t nalt = 0;
+  bcf_unpack(rec, BCF_UN_INFO);
+  bcf_info_t* iac = bcf_get_info(hdr, rec, "AC");
+  bcf_info_t* ian = bcf_get_info(hdr, rec, "AN");
+  if ((iac != NULL) && (ian != NULL) && (iac->len == 1) && (ian->len == 1) && (iac->type != BCF_BT_FLOAT) && (ian->type != BCF_BT_FLOAT) && (iac->v1.i >= 0) && (iac->v1.i <= ian->v1.i)) {
+    na = ian->v1.i;
+    nalt = iac->v1.i;
+  } else {
+    bcf_unpack(rec, BCF_UN_FMT);
+    bcf_fmt_t* fgt = bcf_get_fmt(hdr, rec, "GT");
+    if (fgt == NULL) return 1;
+    int32_t step = std::max(1, nsamples / COST_SAMPLES);
+    for (int32_t i = 0; i < nsamples; i += step) {
+      for (int32_t j = 0; j < fgt->n; ++j) {
+	int32_t v;
+	_packedValue(fgt, i, j, v);
+	if (v == bcf_int32_vector_end) break;
+	if (bcf_gt_allele(v) < 0) continue;
+	na += step;
+	if (bcf_gt_allele(v) > 0) nalt += step;
+      }
+    }
+  }
+  uint64_t mac = std::min(nalt, na - nalt);
+  uint64_t iter = std::min((uint64_t) c.maxiter, 10 + 4 * na / (mac + 1));
+  return (uint64_t) nsamples * iter + 1;
+}
+
+template<typename TRaw, typename TConfig>
+inline void
+_processRecordBatch(TConfig const& c, bcf_hdr_t* hdr, bcf_hdr_t* hdr_out, RecordBatch<TRaw>& b, WorkerState& st) {
+  if (c.maxMemory) {
+    // Memory-bounded, one record estimated from its packed FORMAT fields
+    if (c.singlePrecision) {
+      if (c.reproducible) b.data[0].biallelic = _processBoundedRecord<float, BlockedSum<float>, TRaw>(c, hdr, hdr_out, b.recs[0], st);
+      else b.data[0].biallelic = _processBoundedRecord<float, SumTraits<float>::TSum, TRaw>(c, hdr, hdr_out, b.recs[0], st);
+    } else {
+      if (c.reproducible) b.data[0].biallelic = _processBoundedRecord<double, BlockedSum<double>, TRaw>(c, hdr, hdr_out, b.recs[0], st);
+      else b.data[0].biallelic = _processBoundedRecord<double, SumTraits<double>::TSum, TRaw>(c, hdr, hdr_out, b.recs[0], st);
+    }
+  } else {
+    for(uint32_t i = 0; i < b.n; ++i) _decodeRecord(c, hdr, b.recs[i], b.data[i]);
+    if (c.singlePrecision) {
+      if (c.reproducible) _processBatch<float, BlockedSum<float> >(c, hdr, hdr_out, b.recs, b.data, b.n, st);
+      else _processBatch<float, SumTraits<float>::TSum>(c, hdr, hdr_out, b.recs, b.data, b.n, st);
+    } else {
+      if (c.reproducible) _processBatch<double, BlockedSum<double> >(c, hdr, hdr_out, b.recs, b.data, b.n, st);
+      else _processBatch<double, SumTraits<double>::TSum>(c, hdr, hdr_out, b.recs, b.data, b.n, st);
+    }
+  }
+}
+
+// Move the QC counts of all workers into the checkpoint, workers must be idle
+inline void
+_collectQC(std::vector<WorkerState>& states, Checkpoint& ck) {
+  for(uint32_t w = 0; w < states.size(); ++w) {
+    _mergeSampleQC(states[w].qc, ck.qc);
+    states[w].qc.assign(states[w].qc.size(), SampleQC());
+  }
+}
+
+// Spill the new cache entries of all workers to run files, workers must be idle
+template<typename TConfig>
+inline bool
+_spillWorkerCache(TConfig const& c, std::vector<WorkerState>& states) {
+  bool ok = true;
+  for(uint32_t w = 0; w < states.size(); ++w) {
+    if ((states[w].cacheError) || (!_spillCache(c.cachefile, *states[w].cache, states[w].added))) ok = false;
+    states[w].cacheError = false;
+  }
+  return ok;
+}
+
+// Estimate and write all records, TRaw is the likelihood encoding of the input file
+template<typename TRaw, typename TConfig>
+inline int32_t
+_processRecords(TConfig const& c, htsFile* ifile, bcf_hdr_t* hdr, htsFile* fp, bcf_hdr_t* hdr_out, Checkpoint& ck) {
+  typedef RecordBatch<TRaw> TBatch;
+
+  // Estimates of a previous run with the same EM parameters
+  ResultCache cache;
+  if (c.cache) {
+    CacheHeader header;
+    _cacheHeader(c, c.singlePrecision ? sizeof(float) : sizeof(double), header);
+    _openCache(c.cachefile, header, cache);
+    // Entries spilled by an interrupted run
+    if (!_mergeCache(c.cachefile, cache)) {
+      std::cerr << "Result cache could not be written: " << c.cachefile.string() << std::endl;
+      return 1;
+    }
+    if (_openCache(c.cachefile, header, cache)) std::cout << "Result cache with " << cache.nentries << " sites: " << c.cachefile.string() << std::endl;
+  }
+
+  // Text VCF lines are parsed in parallel and delivered in input order
+  RecordReader reader(ifile, hdr, c.ioThreads);
+
+  std::vector<WorkerState> states(c.threads);
+  for(uint32_t w = 0; w < c.threads; ++w) {
+    states[w].cache = &cache;
+    states[w].qc.resize(ck.qc.size());
+    states[w].mem.budget = c.maxMemory / c.threads;
+    if (c.maxMemory) states[w].gqval.resize(bcf_hdr_nsamples(hdr));
+  }
+
+  // Workers look up tags in a frozen copy of the header, reading text VCF may add undeclared tags to hdr meanwhile
+  bcf_hdr_t* hdr_work = bcf_hdr_dup(hdr);
+
+  // Batches are estimated by the workers and written in input order
+  boost::scoped_ptr<WorkStealingPool<TBatch> > pool;
+  if (c.threads > 1) pool.reset(new WorkStealingPool<TBatch>(c.threads, [&c, hdr_work, hdr_out, &states](uint32_t w, TBatch* b) { _processRecordBatch(c, hdr_work, hdr_out, *b, states[w]); }));
+  uint32_t window = (c.threads > 1) ? 4 * c.threads : 1;
+  uint32_t batchSize = c.batch;
+  if ((c.threads > 1) && (c.batch == 1) && (!c.maxMemory)) batchSize = 8;  // Small batches of sites estimated one by one
+  std::vector<TBatch*> batches;
+  std::vector<TBatch*> freeBatches;
+  std::map<uint64_t, TBatch*> finished;
+  uint64_t nread = 0;
+  uint64_t nwritten = 0;
+  uint32_t inflight = 0;
+  int32_t r = 0;
+  bool eof = false;
+  bool drain = false;
+  while (true) {
+    // Read batches of records
+    while ((!eof) && (!drain) && (inflight < window)) {
+      if (freeBatches.empty()) {
+	batches.push_back(new TBatch(batchSize));
+	freeBatches.push_back(batches.back());
+      }
+      TBatch* b = freeBatches.back();
+      for(b->n = 0; b->n < batchSize; ++b->n) {
+	if (reader.read(b->recs[b->n]) != 0) {
+	  eof = true;
+	  break;
+	}
+      }
+      if (!b->n) break;
+      freeBatches.pop_back();
+      b->seq = nread++;
+      ++inflight;
+      if (pool) {
+	uint64_t cost = 0;
+	for(uint32_t i = 0; i < b->n; ++i) cost += _recordCost(c, hdr_work, b->recs[i]);
+	pool->submit(b, cost);
+      } else {
+	_processRecordBatch(c, hdr_work, hdr_out, *b, states[0]);
+	finished[b->seq] = b;
+      }
+    }
+
+    // Checkpoint once all dispatched batches are written
+    if (!inflight) {
+      if (!drain) break;
+      drain = false;
+      _collectQC(states, ck);
+      if ((c.cache) && (!_spillWorkerCache(c, states))) {
+	std::cerr << "Result cache could not be written: " << c.cachefile.string() << std::endl;
+	r = 1;
+	break;
+      }
+      ck.inoffset = reader.tell();
+      ck.outoffset = _flushBlock(fp);
+      if ((ck.outoffset < 0) || (!_writeCheckpoint(c.outfile, ck))) {
+	std::cerr << "Checkpoint could not be written: " << _checkpointFile(c.outfile).string() << std::endl;
+	r = 1;
+	break;
+      }
+      continue;
+    }
+
+    if (pool) {
+      TBatch* b = pool->wait();
+      finished[b->seq] = b;
+    }
+    while ((!finished.empty()) && (finished.begin()->first == nwritten)) {
+      TBatch* b = finished.begin()->second;
+      finished.erase(finished.begin());
+      for(uint32_t i = 0; i < b->n; ++i) {
+	if (b->data[i].biallelic) {
+	  // Write record
+	  bcf_write1(fp, hdr_out, b->recs[i]);
+	  ++ck.nsites;
+	  ck.rid = b->recs[i]->rid;
+	  ck.pos = b->recs[i]->pos;
+	}
+      }
+      ck.nrec += b->n;
+      if ((c.checkpoint) && ((ck.nrec - b->n) / c.checkpoint != ck.nrec / c.checkpoint)) drain = true;
+      ++nwritten;
+      --inflight;
+      freeBatches.push_back(b);
+    }
+  }
+
+  if (pool) {
+    std::cout << "Threads: " << c.threads << ", batches: " << pool->items() << ", steals: " << pool->steals() << ", core utilization: " << boost::math::iround(100 * pool->utilization()) << "%" << std::endl;
+    pool.reset();
+  }
+  bcf_hdr_destroy(hdr_work);
+  if (reader.serialRecords()) std::cout << "Header changed while parsing, " << reader.serialRecords() << " records parsed serially" << std::endl;
+  for(uint32_t i = 0; i < batches.size(); ++i) delete batches[i];
+
+  // Merge worker statistics
+  _collectQC(states, ck);
+  PrecisionCheck check;
+  MemoryCheck mem;
+  mem.budget = c.maxMemory;
+  for(uint32_t w = 0; w < c.threads; ++w) {
+    check.nsites += states[w].check.nsites;
+    check.ngq += states[w].check.ngq;
+    check.nmask += states[w].check.nmask;
+    check.maxAF = std::max(check.maxAF, states[w].check.maxAF);
+    check.maxGF = std::max(check.maxGF, states[w].check.maxGF);
+    check.maxGQ = std::max(check.maxGQ, states[w].check.maxGQ);
+    mem.peak += states[w].mem.peak;
+    mem.nsites += states[w].mem.nsites;
+    mem.nstreamed += states[w].mem.nstreamed;
+  }
+
+  // Result cache
+  if (c.cache) {
+    uint64_t ncached = 0;
+    uint64_t nadded = 0;
+    for(uint32_t w = 0; w < c.threads; ++w) {
+      ncached += states[w].ncached;
+      nadded += states[w].nadded;
+    }
+    std::cout << "Result cache: " << ncached << " sites reused, " << nadded << " sites estimated" << std::endl;
+    if ((r == 0) && ((!_spillWorkerCache(c, states)) || (!_mergeCache(c.cachefile, cache)))) {
+      std::cerr << "Result cache could not be written: " << c.cachefile.string() << std::endl;
+      r = 1;
+    }
+  }
+
+  // Precision report
+  if (c.validate) {
+    std::cout << "Single vs. double precision: " << check.nsites << " sites, " << check.ngq << " genotypes" << std::endl;
+    std::cout << "Max. deviation AFmle=" << check.maxAF << ", GFmle=" << check.maxGF << ", GQ=" << check.maxGQ << ", changed GT masking=" << check.nmask << std::endl;
+  }
+
+  // Footprint report
+  if (c.maxMemory) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Peak footprint: max. RSS " << usage.ru_maxrss / 1024 << " MB, largest record buffers " << mem.peak / (1024 * 1024) << " MB (budget " << mem.budget / (1024 * 1024) << " MB)" << std::endl;
+    std::cout << "Sample blocks streamed for " << mem.nstreamed << " of " << mem.nsites << " sites" << std::endl;
+    if (mem.peak > mem.budget) std::cout << "Warning: a single record needs more than the memory budget!" << std::endl;
+  }
+  return r;
+}
+
+
 template<typename TConfig>
 inline int32_t 
 _processVCF(TConfig const& c) {
@@ -61,10 +693,60 @@ _processVCF(TConfig const& c) {
   // Open VCF file
   htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
   bcf_hdr_t* hdr = bcf_hdr_read(ifile);
+  if (((c.checkpoint) || (c.resume)) && (hts_get_format(ifile)->compression != bgzf)) {
+    std::cerr << "Checkpointing requires a BCF or bgzipped VCF input file!" << std::endl;
+    bcf_hdr_destroy(hdr);
+    bcf_close(ifile);
+    return 1;
+  }
+  if ((!_formatExists(hdr, "GL")) && (!_formatExists(hdr, "PL"))) {
+    std::cerr << "Input file requires FORMAT/GL or FORMAT/PL genotype likelihoods!" << std::endl;
+    bcf_hdr_destroy(hdr);
+    bcf_close(ifile);
+    return 1;
+  }
+
+  // Undeclared GTs of a text VCF would only be added to the header while reading
+  if (!_formatExists(hdr, "GT")) {
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    bcf_hdr_sync(hdr);
+  }
+
+  // Restore checkpoint
+  Checkpoint ck;
+  ck.sitesOnly = c.sitesOnly;
+  ck.options = _checkpointOptions(c);
+  if (c.qc) ck.qc.resize(bcf_hdr_nsamples(hdr));
+  if ((c.checkpoint) || (c.resume)) ck.insize = boost::filesystem::file_size(c.vcffile);
+  if (c.resume) {
+    if ((!_readCheckpoint(c.outfile, ck)) || (ck.sitesOnly != c.sitesOnly) || (ck.options != _checkpointOptions(c)) || (ck.qc.size() != (c.qc ? (std::size_t) bcf_hdr_nsamples(hdr) : 0)) || (ck.insize != boost::filesystem::file_size(c.vcffile))) {
+      std::cerr << "Checkpoint does not match input file or options: " << _checkpointFile(c.outfile).string() << std::endl;
+      bcf_hdr_destroy(hdr);
+      bcf_close(ifile);
+      return 1;
+    }
+    if (bgzf_seek(hts_get_bgzfp(ifile), ck.inoffset, SEEK_SET) != 0) {
+      std::cerr << "Input file cannot be positioned at the checkpoint!" << std::endl;
+      bcf_hdr_destroy(hdr);
+      bcf_close(ifile);
+      return 1;
+    }
+    if ((ck.outoffset < 0) || (boost::filesystem::file_size(c.outfile) < (uintmax_t) ck.outoffset)) {
+      std::cerr << "Output file is shorter than at the checkpoint: " << c.outfile.string() << std::endl;
+      bcf_hdr_destroy(hdr);
+      bcf_close(ifile);
+      return 1;
+    }
+    // Drop everything written after the last complete block
+    boost::filesystem::resize_file(c.outfile, ck.outoffset);
+    std::cout << "Resuming after " << ck.nrec << " records (" << ck.nsites << " sites written)" << std::endl;
+  }
 
   // Open output file
-  htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
-  bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
+  htsFile *fp = hts_open(c.outfile.string().c_str(), _outputMode(c.outputType, c.compressionLevel, c.resume).c_str());
+  bcf_hdr_t *hdr_out = NULL;
+  if (c.sitesOnly) hdr_out = bcf_hdr_subset(hdr, 0, 0, 0);
+  else hdr_out = bcf_hdr_dup(hdr);
   bcf_hdr_remove(hdr_out, BCF_HL_INFO, "AFmle");
   bcf_hdr_remove(hdr_out, BCF_HL_INFO, "ACmle");
   bcf_hdr_remove(hdr_out, BCF_HL_INFO, "GFmle");
@@ -78,125 +760,38 @@ _processVCF(TConfig const& c) {
   bcf_hdr_append(hdr_out, "##INFO=<ID=FIC,Number=1,Type=Float,Description=\"Inbreeding coefficient estimated from GLs.\">");
   bcf_hdr_append(hdr_out, "##INFO=<ID=RSQ,Number=1,Type=Float,Description=\"Ratio of observed vs. expected variance.\">");
   bcf_hdr_append(hdr_out, "##INFO=<ID=HWEpval,Number=1,Type=Float,Description=\"HWE p-value.\">");
-  bcf_hdr_append(hdr_out, "##FORMAT=<ID=GQ,Number=1,Type=Float,Description=\"Genotype Quality\">");
-  bcf_hdr_write(fp, hdr_out);
-
-  bcf1_t* rec = bcf_init();
-  while (bcf_read(ifile, hdr, rec) == 0) {
-    bcf_unpack(rec, BCF_UN_ALL);
-    if (rec->n_allele == 2) {
-      typedef double TAccuracyType;
-      typedef std::vector<TAccuracyType> TGLs;
-      typedef std::vector<TGLs> TGlVector;
-      TGlVector glVector;
-      int ngl = 0;
-      float* gl = NULL;
-      int ngt = 0;
-      int32_t* gt = NULL;
-      bcf_get_format_float(hdr, rec, "GL", &gl, &ngl);
-      bcf_get_format_int32(hdr, rec, "GT", &gt, &ngt);
-      uint32_t ac[2];
-      ac[0] = 0;
-      ac[1] = 0;
-      for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	if ((bcf_gt_allele(gt[i*2]) != -1) && (bcf_gt_allele(gt[i*2 + 1]) != -1)) {
-	  ++ac[bcf_gt_allele(gt[i*2])];
-	  ++ac[bcf_gt_allele(gt[i*2 + 1])];
-	  TGLs glTriple(3);
-	  for(int k = 0; k<3; k++) glTriple[k] = std::pow((TAccuracyType) 10.0, (TAccuracyType) gl[i * 3 + k]);
-	  glVector.push_back(glTriple);
-	}
-      }
-      TAccuracyType hweAF[2];
-      hweAF[0] = 0.5;
-      hweAF[1] = 0.5;
-      _estBiallelicAF(c, glVector, hweAF);
-      float afest = hweAF[1];
-      _remove_info_tag(hdr_out, rec, "AFmle");
-      bcf_update_info_float(hdr_out, rec, "AFmle", &afest, 1);
-      int32_t acest = boost::math::iround(hweAF[1] * (ac[0] + ac[1]));
-      _remove_info_tag(hdr_out, rec, "ACmle");
-      bcf_update_info_int32(hdr_out, rec, "ACmle", &acest, 1);
-      TAccuracyType mleGTFreq[3];
-      mleGTFreq[0] = 0;
-      mleGTFreq[1] = 0;
-      mleGTFreq[2] = 0;
-      _estBiallelicGTFreq(c, glVector, mleGTFreq);
-      float gfmle[3];
-      gfmle[0] = mleGTFreq[0];
-      gfmle[1] = mleGTFreq[1];
-      gfmle[2] = mleGTFreq[2];
-      _remove_info_tag(hdr_out, rec, "GFmle");
-      bcf_update_info_float(hdr_out, rec, "GFmle", &gfmle, 3);
-      TAccuracyType F = 0;
-      _estBiallelicFIC(glVector, hweAF, F);
-      float fic = F;
-      _remove_info_tag(hdr_out, rec, "FIC");
-      bcf_update_info_float(hdr_out, rec, "FIC", &fic, 1);
-      TAccuracyType rsq = 0;
-      _estBiallelicRSQ(glVector, hweAF, rsq);
-      float rsqfloat = rsq;
-      _remove_info_tag(hdr_out, rec, "RSQ");
-      bcf_update_info_float(hdr_out, rec, "RSQ", &rsqfloat, 1);
-      TAccuracyType pval = 0;
-      _estBiallelicHWE_LRT(glVector, hweAF, mleGTFreq, pval);
-      float hwepval = pval;
-      _remove_info_tag(hdr_out, rec, "HWEpval");
-      bcf_update_info_float(hdr_out, rec, "HWEpval", &hwepval, 1);
-      
-      float* gqval = (float*) malloc(bcf_hdr_nsamples(hdr) * sizeof(float));
-      for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
-	if ((bcf_gt_allele(gt[i*2]) != -1) && (bcf_gt_allele(gt[i*2 + 1]) != -1)) {
-	  TAccuracyType pp[3];
-	  float bestGl = gl[i * 3];
-	  int bestGlIndex = 0;
-	  for(int k = 0; k<3; k++) {
-	    pp[k] = mleGTFreq[k] * std::pow((TAccuracyType) 10.0, (TAccuracyType) gl[i * 3 + k]);
-	    if (gl[i * 3 + k] > bestGl) {
-	      bestGl = gl[i * 3 + k];
-	      bestGlIndex = k;
-	    }
-	  }
-	  TAccuracyType sumPP = pp[0] + pp[1] + pp[2];
-	  TAccuracyType sample_gq = (TAccuracyType) -10.0 * std::log10( (TAccuracyType) 1.0 - pp[bestGlIndex] / sumPP);
-	  if (sample_gq > 99) sample_gq = 99;
-	  gqval[i] = ((float) boost::math::iround(sample_gq * 10)) / ((float) 10.0);
-	  
-	  // Unset GTs
-	  if (gqval[i] < c.gqthreshold) {
-	    gt[i*2] = bcf_gt_missing;
-	    gt[i*2 + 1] = bcf_gt_missing;
-	  }
-	} else {
-	  bcf_float_set_missing(gqval[i]);
-	}
-      }
-      bcf_update_genotypes(hdr_out, rec, gt, bcf_hdr_nsamples(hdr) * 2);
-      _remove_format_tag(hdr_out, rec, "GQ");
-      bcf_update_format_float(hdr_out, rec, "GQ", gqval, bcf_hdr_nsamples(hdr));
+  if (!c.sitesOnly) bcf_hdr_append(hdr_out, "##FORMAT=<ID=GQ,Number=1,Type=Float,Description=\"Genotype Quality\">");
+  // The header of a resumed file is already written, the new tags still need their ids before the workers use them
+  if (c.resume) bcf_hdr_sync(hdr_out);
+  else bcf_hdr_write(fp, hdr_out);
 
-      // Write record
-      bcf_write1(fp, hdr_out, rec);
-      
-      // Clean-up
-      free(gqval);
-      free(gl);
-      free(gt);
-    }
-  }
-  bcf_destroy(rec);
+  // Likelihood encoding is fixed for the whole file
+  int32_t r = 0;
+  if (_formatExists(hdr, "GL")) r = _processRecords<float>(c, ifile, hdr, fp, hdr_out, ck);
+  else r = _processRecords<int32_t>(c, ifile, hdr, fp, hdr_out, ck);
 
   // Close output VCF
   bcf_hdr_destroy(hdr_out);
   hts_close(fp);
 
-  // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
+  // Per-sample QC report
+  if ((r == 0) && (c.qc) && (!_writeSampleQC(c.qcfile, hdr, ck.qc))) {
+    std::cerr << "QC report could not be written: " << c.qcfile.string() << std::endl;
+    r = 1;
+  }
+
+  if (r == 0) {
+    // Build index
+    if (c.index) bcf_index_build(c.outfile.string().c_str(), 14);
+
+    // Run completed, checkpoint is obsolete
+    if ((c.checkpoint) || (c.resume)) boost::filesystem::remove(_checkpointFile(c.outfile));
+  }
 
   // Close VCF
   bcf_hdr_destroy(hdr);
   bcf_close(ifile);
-  return 0;
+  return r;
 }
 
 int main(int argc, char **argv) {
@@ -206,6 +801,8 @@ int main(int argc, char **argv) {
 #endif
 
   Config c;
+  std::string outputType;
+  uint32_t maxMemory = 0;
 
   // Parameter
   boost::program_options::options_description generic("Generic options");
@@ -213,13 +810,28 @@ int main(int argc, char **argv) {
     ("help,?", "show help message")
     ("epsilon,e", boost::program_options::value<double>(&c.epsilon)->default_value(1e-20), "epsilon error")
     ("maxiter,m", boost::program_options::value<uint32_t>(&c.maxiter)->default_value(1000), "max. iterations for MLE")
+    ("float,f", "single-precision kernels with compensated summation")
+    ("batch,b", boost::program_options::value<uint32_t>(&c.batch)->default_value(1), "number of sites estimated together")
+    ("threads,t", boost::program_options::value<uint32_t>(&c.threads)->default_value(1), "number of worker threads")
+    ("io-threads,T", boost::program_options::value<uint32_t>(&c.ioThreads)->default_value(1), "number of decompression and VCF parsing threads")
+    ("max-memory,M", boost::program_options::value<uint32_t>(&maxMemory)->default_value(0), "memory budget in MB, streams sample blocks through the estimators (0: off)")
+    ("reproducible,x", "fixed-order blocked pairwise summation of the EM sums")
+    ("validate-float", "report max. deviation of single- vs. double-precision estimates")
+    ("cache,C", boost::program_options::value<boost::filesystem::path>(&c.cachefile), "per-site result cache, reused by runs with the same epsilon, maxiter and precision")
+    ("qc-report,q", boost::program_options::value<boost::filesystem::path>(&c.qcfile), "per-sample QC report (TSV)")
     ("gqthreshold,g", boost::program_options::value<float>(&c.gqthreshold)->default_value(0), "GQs below will be GT=./.")
-    ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("var.bcf"), "BCF output file")
+    ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("var.bcf"), "output file, - for stdout")
+    ("output-type,O", boost::program_options::value<std::string>(&outputType), "b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: VCF [from file name]")
+    ("compression-level,l", boost::program_options::value<int32_t>(&c.compressionLevel)->default_value(-1), "compression level 0-9 for b/z output (-1: default)")
+    ("no-index", "do not index the output file")
+    ("sites-only,s", "sites-only output, only INFO annotations are written")
+    ("checkpoint,c", boost::program_options::value<uint32_t>(&c.checkpoint)->default_value(0), "write a checkpoint every c records (0: off)")
+    ("resume,r", "resume an interrupted run from its checkpoint")
     ;
 
   boost::program_options::options_description hidden("Hidden options");
   hidden.add_options()
-    ("input-file", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file")
+    ("input-file", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file, - for stdin")
     ;
 
   boost::program_options::positional_options_description pos_args;
@@ -239,13 +851,61 @@ int main(int argc, char **argv) {
     std::cout << visible_options << "\n";
     return 1;
   } 
+  c.sitesOnly = vm.count("sites-only");
+  c.resume = vm.count("resume");
+  c.singlePrecision = vm.count("float");
+  c.validate = vm.count("validate-float");
+  c.qc = vm.count("qc-report");
+  c.reproducible = vm.count("reproducible");
+  c.cache = vm.count("cache");
+  if (c.batch < 1) c.batch = 1;
+  if (c.threads < 1) c.threads = 1;
+  if (c.ioThreads < 1) c.ioThreads = 1;
+  c.maxMemory = (uint64_t) maxMemory * 1024 * 1024;
+  if (c.maxMemory) {
+    if (c.validate) {
+      std::cerr << "--validate-float is not available with --max-memory!" << std::endl;
+      return 1;
+    }
+    // One record at a time
+    c.batch = 1;
+  }
+  c.tileBytes = 256 * 1024;  // L2 share of one sample tile of a batch
+  c.outputType = _outputType(outputType, c.outfile);
+  if (!_validOutputType(c.outputType)) {
+    std::cerr << "Unknown output type: " << outputType << std::endl;
+    return 1;
+  }
+  if (!_validCompressionLevel(c.compressionLevel)) {
+    std::cerr << "Compression level needs to be in [-1, 9]: " << c.compressionLevel << std::endl;
+    return 1;
+  }
+  if ((c.compressionLevel != -1) && (c.outputType != 'b') && (c.outputType != 'z')) {
+    std::cerr << "Compression level requires compressed output (-O b or -O z)!" << std::endl;
+    return 1;
+  }
+  c.index = ((!vm.count("no-index")) && (_indexable(c.outputType, c.outfile)));
   
   // Check VCF file
-  if (!(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
+  if (!_isStream(c.vcffile) && !(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
     std::cerr << "Input VCF/BCF file is missing: " << c.vcffile.string() << std::endl;
     return 1;
   }
 
+  // Check checkpoint
+  if (((c.checkpoint) || (c.resume)) && ((_isStream(c.vcffile)) || (!_indexable(c.outputType, c.outfile)))) {
+    std::cerr << "Checkpointing requires an input file and a compressed BCF/VCF output file!" << std::endl;
+    return 1;
+  }
+  if ((c.resume) && (!(boost::filesystem::exists(c.outfile) && boost::filesystem::exists(_checkpointFile(c.outfile))))) {
+    std::cerr << "Output file or checkpoint to resume from is missing: " << _checkpointFile(c.outfile).string() << std::endl;
+    return 1;
+  }
+
+  // Keep stdout free for the output stream
+  std::streambuf* coutbuf = std::cout.rdbuf();
+  if (_isStream(c.outfile)) std::cout.rdbuf(std::cerr.rdbuf());
+
   // Show cmd
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -257,6 +917,7 @@ int main(int argc, char **argv) {
   // End
   now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+  std::cout.rdbuf(coutbuf);
 
 
 
@@ -24,6 +24,10 @@ Contact: Tobias Rausch (rausch@embl.de)
 #ifndef GQ_H
 #define GQ_H
 
+#include <string>
+#include <boost/filesystem.hpp>
+#include <htslib/vcf.h>
+
 namespace vcfaid
 {
 
@@ -34,6 +38,101 @@ namespace vcfaid
   void _remove_format_tag(bcf_hdr_t* hdr, bcf1_t* rec, std::string const& tag) {
     bcf_update_format(hdr, rec, tag.c_str(), NULL, 0, BCF_HT_INT);  // Type does not matter for n = 0
   }
+
+  inline bool
+  _isStream(boost::filesystem::path const& file) {
+    return (file.string() == "-");
+  }
+
+  // Output type (b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF), guessed from the file name if not given
+  inline char
+  _outputType(std::string const& type, boost::filesystem::path const& outfile) {
+    if (!type.empty()) return type[0];
+    std::string fn = outfile.string();
+    if (_isStream(outfile)) return 'v';
+    if ((fn.size() >= 4) && (fn.substr(fn.size() - 4) == ".vcf")) return 'v';
+    if ((fn.size() >= 3) && (fn.substr(fn.size() - 3) == ".gz")) return 'z';
+    return 'b';
+  }
+
+  inline bool
+  _validOutputType(char const type) {
+    return ((type == 'b') || (type == 'u') || (type == 'z') || (type == 'v'));
+  }
+
+  inline bool
+  _validCompressionLevel(int32_t const level) {
+    return ((level >= -1) && (level <= 9));
+  }
+
+  // htslib open mode, level -1 keeps the BGZF default (a level is rejected for u/v output)
+  inline std::string
+  _outputMode(char const type, int32_t const level, bool const append) {
+    std::string mode(append ? "a" : "w");
+    if (type == 'b') mode += "b";
+    else if (type == 'u') mode += "bu";
+    else if (type == 'z') mode += "z";
+    if (((type == 'b') || (type == 'z')) && (level >= 0)) mode += (char) ('0' + level);
+    return mode;
+  }
+
+  // Only BGZF-compressed files written to disk can be indexed
+  inline bool
+  _indexable(char const type, boost::filesystem::path const& outfile) {
+    return (((type == 'b') || (type == 'z')) && (!_isStream(outfile)));
+  }
+
+  inline bool
+  _formatExists(bcf_hdr_t const* hdr, std::string const& tag) {
+    return bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, bcf_hdr_id2int(hdr, BCF_DT_ID, tag.c_str()));
+  }
+
+  // Genotype likelihood encodings, GL: log10-scaled float, PL: phred-scaled integer
+  template<typename TRaw>
+  struct Encoding;
+
+  template<>
+  struct Encoding<float> {
+    static const int type = BCF_HT_REAL;
+    static char const* tag() { return "GL"; }
+  };
+
+  template<>
+  struct Encoding<int32_t> {
+    static const int type = BCF_HT_INT;
+    static char const* tag() { return "PL"; }
+  };
+
+  // All alleles of a sample are called, ploidy P is the GT stride, shorter (e.g. haploid) genotypes are vector_end padded
+  template<int P>
+  inline bool
+  _calledGT(int32_t const* gt) {
+    if (bcf_gt_allele(gt[0]) == -1) return false;
+    for(int j = 1; j < P; ++j)
+      if ((gt[j] != bcf_int32_vector_end) && (bcf_gt_allele(gt[j]) == -1)) return false;
+    return true;
+  }
+
+  template<int P>
+  inline void
+  _maskGT(int32_t* gt) {
+    gt[0] = bcf_gt_missing;
+    for(int j = 1; j < P; ++j)
+      if (gt[j] != bcf_int32_vector_end) gt[j] = bcf_gt_missing;
+  }
+
+  // Number of alleles and alternative alleles of a called genotype
+  template<int P>
+  inline void
+  _countAlleles(int32_t const* gt, int32_t& na, int32_t& nalt) {
+    na = 0;
+    nalt = 0;
+    for(int j = 0; j < P; ++j) {
+      if (gt[j] == bcf_int32_vector_end) break;
+      ++na;
+      nalt += bcf_gt_allele(gt[j]);
+    }
+  }
 }
 
 #endif
@@ -24,6 +24,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define _SECURE_SCL 0
 #define _SCL_SECURE_NO_WARNINGS
 #include <iostream>
+#include <limits>
 #include <vector>
 #include <fstream>
 
@@ -46,12 +47,40 @@ Contact: Tobias Rausch (rausch@embl.de)
 using namespace vcfaid;
 
 struct Config {
+  bool index;
+  char outputType;
+  int32_t compressionLevel;
   int32_t gqthreshold;
   boost::filesystem::path outfile;
   boost::filesystem::path vcffile;
 };
 
 
+// FORMAT/GQ of all samples, Float as written by gq or Integer as written by most callers; missing GQs are NaN
+inline bool
+_sampleGQs(bcf_hdr_t* hdr, bcf1_t* rec, int32_t const nsamples, std::vector<float>& gqval) {
+  gqval.assign(nsamples, std::numeric_limits<float>::quiet_NaN());
+  int nval = 0;
+  float* fgq = NULL;
+  if (bcf_get_format_float(hdr, rec, "GQ", &fgq, &nval) == nsamples) {
+    for (int i = 0; i < nsamples; ++i)
+      if (!bcf_float_is_missing(fgq[i])) gqval[i] = fgq[i];
+    free(fgq);
+    return true;
+  }
+  free(fgq);
+  nval = 0;
+  int32_t* igq = NULL;
+  if (bcf_get_format_int32(hdr, rec, "GQ", &igq, &nval) == nsamples) {
+    for (int i = 0; i < nsamples; ++i)
+      if (igq[i] != bcf_int32_missing) gqval[i] = igq[i];
+    free(igq);
+    return true;
+  }
+  free(igq);
+  return false;
+}
+
 template<typename TConfig>
 inline int32_t 
 _setToMissing(TConfig const& c) {
@@ -61,32 +90,38 @@ _setToMissing(TConfig const& c) {
   bcf_hdr_t* hdr = bcf_hdr_read(ifile);
 
   // Open output file
-  htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+  htsFile *fp = hts_open(c.outfile.string().c_str(), _outputMode(c.outputType, c.compressionLevel, false).c_str());
   bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
   bcf_hdr_write(fp, hdr_out);
 
+  std::vector<float> gq;
   bcf1_t* rec = bcf_init();
   while (bcf_read(ifile, hdr, rec) == 0) {
     bcf_unpack(rec, BCF_UN_ALL);
     int ngt = 0;
     int32_t* gt = NULL;
-    int ngq = 0;
-    int32_t* gq = NULL;
-    bcf_get_format_int32(hdr, rec, "GT", &gt, &ngt);
-    bcf_get_format_int32(hdr, rec, "GQ", &gq, &ngq);
+    int32_t nsamples = bcf_hdr_nsamples(hdr);
+    int32_t ngtval = (nsamples) ? bcf_get_format_int32(hdr, rec, "GT", &gt, &ngt) : 0;
+    if ((ngtval <= 0) || (!_sampleGQs(hdr, rec, nsamples, gq))) {
+      // No genotypes (e.g. sites-only input) or no GQs, nothing to mask
+      bcf_write1(fp, hdr_out, rec);
+      free(gt);
+      continue;
+    }
+    int32_t ploidy = ngtval / nsamples;
     for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i) {
       if (gq[i] < c.gqthreshold) {
-	gt[i*2] = bcf_gt_missing;
-	gt[i*2 + 1] = bcf_gt_missing;
+	// Keep the vector_end padding of haploid samples
+	for (int j = 0; j < ploidy; ++j)
+	  if (gt[i*ploidy + j] != bcf_int32_vector_end) gt[i*ploidy + j] = bcf_gt_missing;
       }
     }
-    bcf_update_genotypes(hdr_out, rec, gt, bcf_hdr_nsamples(hdr) * 2);
+    bcf_update_genotypes(hdr_out, rec, gt, bcf_hdr_nsamples(hdr) * ploidy);
 
     // Write record
     bcf_write1(fp, hdr_out, rec);
     
     // Clean-up
-    free(gq);
     free(gt);
   }
   bcf_destroy(rec);
@@ -96,7 +131,7 @@ _setToMissing(TConfig const& c) {
   hts_close(fp);
 
   // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
+  if (c.index) bcf_index_build(c.outfile.string().c_str(), 14);
 
   // Close VCF
   bcf_hdr_destroy(hdr);
@@ -111,18 +146,22 @@ int main(int argc, char **argv) {
 #endif
 
   Config c;
+  std::string outputType;
 
   // Parameter
   boost::program_options::options_description generic("Generic options");
   generic.add_options()
     ("help,?", "show help message")
     ("gqthreshold,g", boost::program_options::value<int32_t>(&c.gqthreshold)->default_value(20), "GQs below will be GT=./.")
-    ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("var.bcf"), "BCF output file")
+    ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("var.bcf"), "output file, - for stdout")
+    ("output-type,O", boost::program_options::value<std::string>(&outputType), "b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: VCF [from file name]")
+    ("compression-level,l", boost::program_options::value<int32_t>(&c.compressionLevel)->default_value(-1), "compression level 0-9 for b/z output (-1: default)")
+    ("no-index", "do not index the output file")
     ;
 
   boost::program_options::options_description hidden("Hidden options");
   hidden.add_options()
-    ("input-file", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file")
+    ("input-file", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file, - for stdin")
     ;
 
   boost::program_options::positional_options_description pos_args;
@@ -142,13 +181,31 @@ int main(int argc, char **argv) {
     std::cout << visible_options << "\n";
     return 1;
   } 
+  c.outputType = _outputType(outputType, c.outfile);
+  if (!_validOutputType(c.outputType)) {
+    std::cerr << "Unknown output type: " << outputType << std::endl;
+    return 1;
+  }
+  if (!_validCompressionLevel(c.compressionLevel)) {
+    std::cerr << "Compression level needs to be in [-1, 9]: " << c.compressionLevel << std::endl;
+    return 1;
+  }
+  if ((c.compressionLevel != -1) && (c.outputType != 'b') && (c.outputType != 'z')) {
+    std::cerr << "Compression level requires compressed output (-O b or -O z)!" << std::endl;
+    return 1;
+  }
+  c.index = ((!vm.count("no-index")) && (_indexable(c.outputType, c.outfile)));
   
   // Check VCF file
-  if (!(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
+  if (!_isStream(c.vcffile) && !(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
     std::cerr << "Input VCF/BCF file is missing: " << c.vcffile.string() << std::endl;
     return 1;
   }
 
+  // Keep stdout free for the output stream
+  std::streambuf* coutbuf = std::cout.rdbuf();
+  if (_isStream(c.outfile)) std::cout.rdbuf(std::cerr.rdbuf());
+
   // Show cmd
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -160,6 +217,7 @@ int main(int argc, char **argv) {
   // End
   now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+  std::cout.rdbuf(coutbuf);
 
 
 #ifdef PROFILE
@@ -0,0 +1,278 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <htslib/bgzf.h>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+#include <htslib/vcf.h>
+
+namespace vcfaid
+{
+
+  // Lines of a text VCF are read in batches of at most LINE_BATCH_SIZE lines or LINE_BATCH_BYTES
+  static const uint32_t LINE_BATCH_SIZE = 256;
+  static const std::size_t LINE_BATCH_BYTES = 8 * 1024 * 1024;
+
+  // Lines read by the reader thread, parsed by one of the workers
+  struct LineBatch {
+    uint64_t seq;
+    uint32_t n;
+    uint32_t nparsed;  // Lines parsed by the worker, the header of the worker changed at line nparsed if nparsed < n
+    std::vector<kstring_t> lines;
+    std::vector<int64_t> offsets;  // Virtual offset after each line
+    std::vector<int32_t> status;  // vcf_parse return values
+    std::vector<bcf1_t*> recs;
+
+    LineBatch() : seq(0), n(0), nparsed(0), lines(LINE_BATCH_SIZE), offsets(LINE_BATCH_SIZE, 0), status(LINE_BATCH_SIZE, 0), recs(LINE_BATCH_SIZE) {
+      for(uint32_t i = 0; i < LINE_BATCH_SIZE; ++i) {
+	lines[i].l = 0;
+	lines[i].m = 0;
+	lines[i].s = NULL;
+	recs[i] = bcf_init();
+      }
+    }
+
+    ~LineBatch() {
+      for(uint32_t i = 0; i < LINE_BATCH_SIZE; ++i) {
+	free(lines[i].s);
+	bcf_destroy(recs[i]);
+      }
+    }
+  };
+
+  // Records of a VCF/BCF file in input order, a drop-in for bcf_read, using at most nthreads threads. BCF blocks are
+  // decompressed by the htslib thread pool. For a text VCF one thread reads lines (a quarter of the threads decompress
+  // BGZF blocks) and the others parse them, each with its own copy of the header. A line that adds a contig, INFO or
+  // FORMAT tag to the header switches the rest of the file to serial parsing with the shared header, so record ids
+  // always match the header the caller uses.
+  class RecordReader {
+  public:
+    RecordReader(htsFile* f, bcf_hdr_t* h, uint32_t const nthreads) : ifile(f), hdr(h), bgzfInput(false), parallel(false), serial(false), stop(false), eof(false), nread(0), nnext(0), firstSerial(UINT64_MAX), current(NULL), k(0), offset(-1), nserial(0) {
+      htsFormat const* fmt = hts_get_format(ifile);
+      bgzfInput = (fmt->compression == bgzf);
+      parallel = ((nthreads > 1) && (fmt->format == vcf));
+      uint32_t nbgzf = (parallel) ? nthreads / 4 : ((nthreads > 1) ? nthreads : 0);
+      uint32_t nparse = (parallel) ? std::max(1U, nthreads - 1 - nbgzf) : 0;
+      if ((nbgzf) && (bgzfInput)) hts_set_threads(ifile, nbgzf);
+      if (bgzfInput) offset = bgzf_tell(hts_get_bgzfp(ifile));
+      if (parallel) {
+	for(uint32_t i = 0; i < 4 * nparse; ++i) {
+	  batches.push_back(new LineBatch());
+	  freeBatches.push_back(batches.back());
+	}
+	for(uint32_t w = 0; w < nparse; ++w) headers.push_back(bcf_hdr_dup(hdr));
+	for(uint32_t w = 0; w < nparse; ++w) workers.push_back(std::thread(&RecordReader::parse, this, w));
+	reader = std::thread(&RecordReader::readLines, this);
+      }
+    }
+
+    ~RecordReader() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	stop = true;
+      }
+      cvRead.notify_all();
+      cvParse.notify_all();
+      if (reader.joinable()) reader.join();
+      for(uint32_t w = 0; w < workers.size(); ++w) workers[w].join();
+      for(uint32_t w = 0; w < headers.size(); ++w) bcf_hdr_destroy(headers[w]);
+      for(uint32_t i = 0; i < batches.size(); ++i) delete batches[i];
+    }
+
+    // Next record, returns 0 on success, -1 at the end of the file and < -1 on errors (as bcf_read)
+    inline int
+    read(bcf1_t* rec) {
+      if (!parallel) {
+	int ret = bcf_read(ifile, hdr, rec);
+	if ((ret == 0) && (bgzfInput)) offset = bgzf_tell(hts_get_bgzfp(ifile));
+	return ret;
+      }
+      if ((current != NULL) && (k == current->n)) {
+	release(current);
+	current = NULL;
+      }
+      if (current == NULL) {
+	std::unique_lock<std::mutex> lock(mtx);
+	cvDone.wait(lock, [this]() { return ((parsed.count(nnext)) || ((eof) && (nnext == nread))); });
+	if (!parsed.count(nnext)) return -1;
+	current = parsed[nnext];
+	parsed.erase(nnext);
+	++nnext;
+	k = 0;
+      }
+      int ret = 0;
+      if ((!serialFrom(current)) || (k < current->nparsed)) {
+	// Records own their buffers, swapping hands the parsed record to the caller
+	std::swap(*rec, *current->recs[k]);
+	ret = current->status[k];
+      } else {
+	ret = vcf_parse(&current->lines[k], hdr, rec);
+	++nserial;
+      }
+      offset = current->offsets[k];
+      ++k;
+      return ret;
+    }
+
+    // Virtual offset after the last record returned by read, -1 if the input is not BGZF-compressed
+    inline int64_t tell() const { return offset; }
+
+    // Records parsed serially after a header change
+    inline uint64_t serialRecords() const { return nserial; }
+
+  private:
+    // Caller parses all lines of this and all later batches once a worker saw a header change
+    inline bool
+    serialFrom(LineBatch const* b) {
+      if (b->nparsed < b->n) firstSerial = std::min(firstSerial, b->seq);
+      return (b->seq >= firstSerial);
+    }
+
+    inline void
+    release(LineBatch* b) {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	freeBatches.push_back(b);
+      }
+      cvRead.notify_one();
+    }
+
+    inline void
+    readLines() {
+      while (true) {
+	LineBatch* b = NULL;
+	{
+	  std::unique_lock<std::mutex> lock(mtx);
+	  cvRead.wait(lock, [this]() { return ((stop) || (!freeBatches.empty())); });
+	  if (stop) return;
+	  b = freeBatches.back();
+	  freeBatches.pop_back();
+	}
+	std::size_t bytes = 0;
+	bool last = false;
+	for(b->n = 0; (b->n < LINE_BATCH_SIZE) && (bytes < LINE_BATCH_BYTES); ++b->n) {
+	  if (hts_getline(ifile, '\n', &b->lines[b->n]) < 0) {
+	    last = true;
+	    break;
+	  }
+	  bytes += b->lines[b->n].l;
+	  b->offsets[b->n] = (bgzfInput) ? bgzf_tell(hts_get_bgzfp(ifile)) : -1;
+	}
+	{
+	  std::lock_guard<std::mutex> lock(mtx);
+	  if (b->n) {
+	    b->seq = nread++;
+	    todo.push_back(b);
+	  } else freeBatches.push_back(b);
+	  if (last) eof = true;
+	}
+	cvParse.notify_one();
+	if (last) {
+	  cvDone.notify_all();
+	  return;
+	}
+      }
+    }
+
+    inline void
+    parse(uint32_t const w) {
+      bcf_hdr_t* h = headers[w];
+      kstring_t line;
+      line.l = 0;
+      line.m = 0;
+      line.s = NULL;
+      while (true) {
+	LineBatch* b = NULL;
+	bool skip = false;
+	{
+	  std::unique_lock<std::mutex> lock(mtx);
+	  cvParse.wait(lock, [this]() { return ((stop) || (!todo.empty())); });
+	  if (stop) break;
+	  b = todo.front();
+	  todo.pop_front();
+	  skip = serial;
+	}
+	b->nparsed = 0;
+	if (!skip) {
+	  for(; b->nparsed < b->n; ++b->nparsed) {
+	    int32_t nid = h->n[BCF_DT_ID];
+	    int32_t nctg = h->n[BCF_DT_CTG];
+	    // vcf_parse tokenizes in place, the line is kept for a serial re-parse
+	    line.l = 0;
+	    kputsn(b->lines[b->nparsed].s, b->lines[b->nparsed].l, &line);
+	    b->status[b->nparsed] = vcf_parse(&line, h, b->recs[b->nparsed]);
+	    if ((h->n[BCF_DT_ID] != nid) || (h->n[BCF_DT_CTG] != nctg)) break;
+	  }
+	}
+	{
+	  std::lock_guard<std::mutex> lock(mtx);
+	  if (b->nparsed < b->n) serial = true;
+	  parsed[b->seq] = b;
+	}
+	cvDone.notify_all();
+      }
+      free(line.s);
+    }
+
+    htsFile* ifile;
+    bcf_hdr_t* hdr;
+    bool bgzfInput;
+    bool parallel;
+    bool serial;  // A header changed, workers skip parsing
+    bool stop;
+    bool eof;
+    uint64_t nread;
+    uint64_t nnext;
+    uint64_t firstSerial;
+    LineBatch* current;
+    uint32_t k;
+    int64_t offset;
+    uint64_t nserial;
+    std::vector<LineBatch*> batches;
+    std::vector<LineBatch*> freeBatches;
+    std::deque<LineBatch*> todo;
+    std::map<uint64_t, LineBatch*> parsed;
+    std::vector<bcf_hdr_t*> headers;
+    std::vector<std::thread> workers;
+    std::thread reader;
+    std::mutex mtx;
+    std::condition_variable cvRead;
+    std::condition_variable cvParse;
+    std::condition_variable cvDone;
+  };
+
+}
+
+#endif
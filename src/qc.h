@@ -0,0 +1,116 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef QC_H
+#define QC_H
+
+#include <fstream>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/math/special_functions/round.hpp>
+#include <htslib/vcf.h>
+
+#include "arfer.h"
+#include "gq.h"
+
+namespace vcfaid
+{
+
+  // Fractional sums are kept in fixed point, so merged accumulators do not depend on the merge order
+  static const double QC_FIXED_POINT = 1000000000.0;
+
+  // Per-sample QC accumulated over all sites
+  struct SampleQC {
+    uint64_t ncalled;
+    uint64_t nmasked;
+    uint64_t nhet;
+    uint64_t nhomalt;
+    uint64_t sumGQ;  // GQ * 10
+    int64_t obsHet;  // Posterior het. probability under HWE
+    int64_t expHet;  // 2pq
+
+    SampleQC() : ncalled(0), nmasked(0), nhet(0), nhomalt(0), sumGQ(0), obsHet(0), expHet(0) {}
+  };
+
+  // Called genotype of a sample with ploidy P, lik are its scaled likelihoods
+  template<int P, typename TGLs, typename TValue>
+  inline void
+  _sampleQC(TGLs const& lik, int32_t const* gt, float const gq, bool const masked, TValue const (&hweAF)[2], SampleQC& qc) {
+    ++qc.ncalled;
+    if (masked) ++qc.nmasked;
+    int32_t na = 0;
+    int32_t nalt = 0;
+    _countAlleles<P>(gt, na, nalt);
+    if ((nalt > 0) && (nalt < na)) ++qc.nhet;
+    else if (nalt > 0) ++qc.nhomalt;
+    qc.sumGQ += boost::math::lround(gq * 10);
+
+    // Inbreeding from the genotype posteriors, undefined at haploid sites and for haploid samples (e.g. chrX of males)
+    if ((lik.size() == 3) && (gt[P - 1] != bcf_int32_vector_end)) {
+      TValue hweGT[3];
+      _hweGenotypes(hweAF, hweGT);
+      TValue p = lik[0] * hweGT[0] + lik[1] * hweGT[1] + lik[2] * hweGT[2];
+      if (p > 0) {
+	qc.obsHet += boost::math::llround(((double) (lik[1] * hweGT[1] / p)) * QC_FIXED_POINT);
+	qc.expHet += boost::math::llround(((double) hweGT[1]) * QC_FIXED_POINT);
+      }
+    }
+  }
+
+  inline void
+  _mergeSampleQC(std::vector<SampleQC> const& from, std::vector<SampleQC>& to) {
+    if (to.size() < from.size()) to.resize(from.size());
+    for(std::size_t i = 0; i < from.size(); ++i) {
+      to[i].ncalled += from[i].ncalled;
+      to[i].nmasked += from[i].nmasked;
+      to[i].nhet += from[i].nhet;
+      to[i].nhomalt += from[i].nhomalt;
+      to[i].sumGQ += from[i].sumGQ;
+      to[i].obsHet += from[i].obsHet;
+      to[i].expHet += from[i].expHet;
+    }
+  }
+
+  inline bool
+  _writeSampleQC(boost::filesystem::path const& qcfile, bcf_hdr_t const* hdr, std::vector<SampleQC> const& qc) {
+    std::ofstream ofile(qcfile.string().c_str());
+    if (!ofile.is_open()) return false;
+    ofile << "sample\tcalled\tmeanGQ\tfracMasked\thet\thomalt\thetHomRatio\tF" << std::endl;
+    for(std::size_t i = 0; i < qc.size(); ++i) {
+      ofile << hdr->samples[i] << '\t' << qc[i].ncalled << '\t';
+      if (qc[i].ncalled) ofile << ((double) qc[i].sumGQ / 10.0) / (double) qc[i].ncalled << '\t' << (double) qc[i].nmasked / (double) qc[i].ncalled << '\t';
+      else ofile << "NA\tNA\t";
+      ofile << qc[i].nhet << '\t' << qc[i].nhomalt << '\t';
+      if (qc[i].nhomalt) ofile << (double) qc[i].nhet / (double) qc[i].nhomalt << '\t';
+      else ofile << "NA\t";
+      if (qc[i].expHet > 0) ofile << 1.0 - (double) qc[i].obsHet / (double) qc[i].expHet << std::endl;
+      else ofile << "NA" << std::endl;
+    }
+    ofile.close();
+    return !ofile.fail();
+  }
+
+}
+
+#endif
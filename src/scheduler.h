@@ -0,0 +1,170 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vcfaid
+{
+
+  // Work-stealing pool for independent items of very different cost. Each worker owns a deque, new items go to
+  // the worker with the least queued cost (greedy LPT), a worker takes its oldest item and an idle worker steals
+  // the most expensive item of the most loaded worker. Items are coarse (a batch of records), so one lock guards
+  // all deques. Finished items are handed back in completion order.
+  template<typename TItem>
+  class WorkStealingPool {
+  public:
+    typedef std::function<void(uint32_t, TItem*)> TWork;
+
+    WorkStealingPool(uint32_t const nthreads, TWork const& work) : fn(work), queues(nthreads), queued(nthreads, 0), busy(nthreads, 0), nsteals(0), nitems(0), stop(false) {
+      start = std::chrono::steady_clock::now();
+      for(uint32_t w = 0; w < nthreads; ++w) threads.push_back(std::thread(&WorkStealingPool::run, this, w));
+    }
+
+    ~WorkStealingPool() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	stop = true;
+      }
+      cvWork.notify_all();
+      for(uint32_t w = 0; w < threads.size(); ++w) threads[w].join();
+    }
+
+    inline void
+    submit(TItem* item, uint64_t const cost) {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	uint32_t best = 0;
+	for(uint32_t w = 1; w < queues.size(); ++w)
+	  if (queued[w] < queued[best]) best = w;
+	queues[best].push_back(Task(item, cost));
+	queued[best] += cost;
+	++nitems;
+      }
+      cvWork.notify_one();
+    }
+
+    // Next finished item, blocks until one is available
+    inline TItem*
+    wait() {
+      std::unique_lock<std::mutex> lock(mtx);
+      cvDone.wait(lock, [this]() { return !done.empty(); });
+      TItem* item = done.front();
+      done.pop_front();
+      return item;
+    }
+
+    // Busy time of all workers relative to the wall time since the pool started
+    inline double
+    utilization() {
+      std::lock_guard<std::mutex> lock(mtx);
+      double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      double sum = 0;
+      for(uint32_t w = 0; w < busy.size(); ++w) sum += busy[w];
+      if (!(wall > 0)) return 0;
+      return sum / (wall * busy.size());
+    }
+
+    inline uint64_t steals() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return nsteals;
+    }
+
+    inline uint64_t items() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return nitems;
+    }
+
+  private:
+    typedef std::pair<TItem*, uint64_t> Task;
+
+    // Caller holds the lock
+    inline bool
+    take(uint32_t const w, Task& task) {
+      if (!queues[w].empty()) {
+	task = queues[w].front();
+	queues[w].pop_front();
+	queued[w] -= task.second;
+	return true;
+      }
+      uint32_t victim = w;
+      for(uint32_t v = 0; v < queues.size(); ++v)
+	if ((!queues[v].empty()) && ((victim == w) || (queued[v] > queued[victim]))) victim = v;
+      if (victim == w) return false;
+      typename std::deque<Task>::iterator itMax = queues[victim].begin();
+      for(typename std::deque<Task>::iterator it = queues[victim].begin(); it != queues[victim].end(); ++it)
+	if (it->second > itMax->second) itMax = it;
+      task = *itMax;
+      queues[victim].erase(itMax);
+      queued[victim] -= task.second;
+      ++nsteals;
+      return true;
+    }
+
+    inline void
+    run(uint32_t const w) {
+      while (true) {
+	Task task;
+	{
+	  std::unique_lock<std::mutex> lock(mtx);
+	  cvWork.wait(lock, [this, w, &task]() { return (stop) || (take(w, task)); });
+	  if (task.first == NULL) return;
+	}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	fn(w, task.first);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	{
+	  std::lock_guard<std::mutex> lock(mtx);
+	  busy[w] += elapsed;
+	  done.push_back(task.first);
+	}
+	cvDone.notify_one();
+      }
+    }
+
+    TWork fn;
+    std::vector<std::deque<Task> > queues;
+    std::vector<uint64_t> queued;
+    std::vector<double> busy;
+    uint64_t nsteals;
+    uint64_t nitems;
+    bool stop;
+    std::deque<TItem*> done;
+    std::vector<std::thread> threads;
+    std::mutex mtx;
+    std::condition_variable cvWork;
+    std::condition_variable cvDone;
+    std::chrono::steady_clock::time_point start;
+  };
+
+}
+
+#endif
@@ -0,0 +1,250 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <cstring>
+#include <vector>
+#include <boost/array.hpp>
+#include <htslib/vcf.h>
+
+#include "arfer.h"
+#include "gq.h"
+
+namespace vcfaid
+{
+
+  // Scaled likelihoods of a called sample, a haploid sample of a diploid site (e.g. chrX of males) is a homozygous genotype
+  template<int P, typename TRaw, typename TGLs>
+  inline void
+  _sampleLikelihoods(TRaw const* gl, int32_t const* gt, TGLs& lik) {
+    typedef typename TGLs::value_type TValue;
+    if ((P == 2) && (gt[P - 1] == bcf_int32_vector_end)) {
+      boost::array<TValue, 2> hap;
+      _scaledLikelihoods(gl, hap);
+      lik[0] = hap[0];
+      lik[1] = 0;
+      lik[TGLs::static_size - 1] = hap[1];
+    } else _scaledLikelihoods(gl, lik);
+  }
+
+  // Scaled likelihoods of all called samples
+  template<int P, typename TRaw, typename TGlVector>
+  inline void
+  _siteLikelihoods(int32_t const nsamples, TRaw const* gl, int32_t const* gt, TGlVector& glVector) {
+    typedef typename TGlVector::value_type TGLs;
+    glVector.clear();
+    glVector.reserve(nsamples);
+    for(int i = 0; i < nsamples; ++i) {
+      if (_calledGT<P>(gt + i * P)) {
+	TGLs glTriple;
+	_sampleLikelihoods<P>(gl + i * TGLs::static_size, gt + i * P, glTriple);
+	glVector.push_back(glTriple);
+      }
+    }
+  }
+
+  // Value j of sample i of a packed FORMAT field, integers keep the int32 missing and vector_end codes
+  inline void
+  _packedValue(bcf_fmt_t const* fmt, int32_t const i, int32_t const j, int32_t& val) {
+    uint8_t const* p = fmt->p + i * fmt->size;
+    switch (fmt->type) {
+    case BCF_BT_INT8: {
+      int8_t v = ((int8_t const*) p)[j];
+      val = (v == bcf_int8_missing) ? bcf_int32_missing : ((v == bcf_int8_vector_end) ? bcf_int32_vector_end : v);
+      break;
+    }
+    case BCF_BT_INT16: {
+      int16_t v;
+      std::memcpy(&v, p + j * sizeof(int16_t), sizeof(int16_t));
+      val = (v == bcf_int16_missing) ? bcf_int32_missing : ((v == bcf_int16_vector_end) ? bcf_int32_vector_end : v);
+      break;
+    }
+    default:
+      std::memcpy(&val, p + j * sizeof(int32_t), sizeof(int32_t));
+    }
+  }
+
+  inline void
+  _packedValue(bcf_fmt_t const* fmt, int32_t const i, int32_t const j, float& val) {
+    std::memcpy(&val, fmt->p + i * fmt->size + j * sizeof(float), sizeof(float));
+  }
+
+  // FORMAT/GT of a record, read and masked in place without unpacking it into an int32 array
+  template<int P>
+  struct PackedGT {
+    bcf_fmt_t* fmt;
+
+    explicit PackedGT(bcf_fmt_t* f) : fmt(f) {}
+  };
+
+  template<int P>
+  inline int32_t*
+  _sampleGT(int32_t* gt, int32_t const i, int32_t (&)[P]) {
+    return gt + i * P;
+  }
+
+  template<int P>
+  inline int32_t*
+  _sampleGT(PackedGT<P> const& gt, int32_t const i, int32_t (&buf)[P]) {
+    for(int j = 0; j < P; ++j) _packedValue(gt.fmt, i, j, buf[j]);
+    return buf;
+  }
+
+  template<int P>
+  inline void
+  _maskSampleGT(int32_t* gt, int32_t const i) {
+    _maskGT<P>(gt + i * P);
+  }
+
+  // bcf_gt_missing is 0 for every integer width
+  template<int P>
+  inline void
+  _maskSampleGT(PackedGT<P> const& gt, int32_t const i) {
+    for(int j = 0; j < P; ++j) {
+      int32_t v;
+      _packedValue(gt.fmt, i, j, v);
+      if (v == bcf_int32_vector_end) continue;
+      std::memset(gt.fmt->p + i * gt.fmt->size + j * (gt.fmt->size / P), 0, gt.fmt->size / P);
+    }
+  }
+
+  template<int P>
+  inline void
+  _updateGenotypes(bcf_hdr_t* hdr, bcf1_t* rec, int32_t* gt, int32_t const nsamples) {
+    bcf_update_genotypes(hdr, rec, gt, nsamples * P);
+  }
+
+  template<int P>
+  inline void
+  _updateGenotypes(bcf_hdr_t*, bcf1_t*, PackedGT<P> const&, int32_t const) {
+    // Masked in place
+  }
+
+  template<typename TSite>
+  class StreamedSiteIterator;
+
+  // Called samples of a record, decoded block by block from the packed FORMAT fields on every pass.
+  // The estimators only keep their running sums, so the footprint is one block instead of all samples.
+  template<int P, typename TRaw, typename TGLs>
+  struct StreamedSite {
+    typedef TGLs value_type;
+    typedef StreamedSiteIterator<StreamedSite> const_iterator;
+
+    bcf_fmt_t const* fgl;
+    bcf_fmt_t const* fgt;
+    int32_t nsamples;
+    std::size_t ncalled;
+    std::size_t blockSize;
+    mutable std::vector<TGLs> block;
+
+    StreamedSite(bcf_fmt_t const* l, bcf_fmt_t const* g, int32_t const n, std::size_t const bs) : fgl(l), fgt(g), nsamples(n), ncalled(0), blockSize(bs) {
+      int32_t gt[P];
+      for(int32_t i = 0; i < nsamples; ++i) {
+	for(int j = 0; j < P; ++j) _packedValue(fgt, i, j, gt[j]);
+	if (_calledGT<P>(gt)) ++ncalled;
+      }
+      block.reserve(blockSize);
+    }
+
+    inline bool empty() const { return (ncalled == 0); }
+    inline std::size_t size() const { return ncalled; }
+
+    // Decode the next block of called samples starting at sample i, returns the next undecoded sample
+    inline int32_t
+    fill(int32_t i) const {
+      block.clear();
+      int32_t gt[P];
+      TRaw gl[P + 1];
+      for(; (i < nsamples) && (block.size() < blockSize); ++i) {
+	for(int j = 0; j < P; ++j) _packedValue(fgt, i, j, gt[j]);
+	if (!_calledGT<P>(gt)) continue;
+	for(int j = 0; j < P + 1; ++j) _packedValue(fgl, i, j, gl[j]);
+	TGLs lik;
+	_sampleLikelihoods<P>(gl, gt, lik);
+	block.push_back(lik);
+      }
+      return i;
+    }
+
+    inline const_iterator begin() const { return const_iterator(this, false); }
+    inline const_iterator end() const { return const_iterator(this, true); }
+  };
+
+  // Forward pass over a streamed site, only one pass may be active at a time
+  template<typename TSite>
+  class StreamedSiteIterator {
+  public:
+    StreamedSiteIterator(TSite const* s, bool const atEnd) : site(s), next(0), k(0), done(atEnd) {
+      if (!done) {
+	next = site->fill(0);
+	done = site->block.empty();
+      }
+    }
+
+    inline typename TSite::value_type const& operator*() const { return site->block[k]; }
+    inline typename TSite::value_type const* operator->() const { return &site->block[k]; }
+
+    inline StreamedSiteIterator& operator++() {
+      if (++k == site->block.size()) {
+	k = 0;
+	next = site->fill(next);
+	done = site->block.empty();
+      }
+      return *this;
+    }
+
+    inline bool operator==(StreamedSiteIterator const& o) const {
+      if ((done) || (o.done)) return (done == o.done);
+      return ((next == o.next) && (k == o.k));
+    }
+    inline bool operator!=(StreamedSiteIterator const& o) const { return !(*this == o); }
+
+  private:
+    TSite const* site;
+    int32_t next;
+    std::size_t k;
+    bool done;
+  };
+
+  // Haploid streamed sites, like haploid likelihood vectors, are estimated by _estHaploid
+  template<typename TSum, typename TConfig, typename TRaw, typename TValue>
+  inline void
+  _estBiallelic(TConfig const& c, StreamedSite<1, TRaw, boost::array<TValue, 2> > const& site, BiallelicEstimate<TValue>& est) {
+    _estHaploid<TSum>(c, site, est);
+  }
+
+  // Largest per-record buffers of the memory-bounded mode
+  struct MemoryCheck {
+    uint64_t budget;
+    uint64_t peak;
+    uint64_t nsites;
+    uint64_t nstreamed;
+
+    MemoryCheck() : budget(0), peak(0), nsites(0), nstreamed(0) {}
+  };
+
+}
+
+#endif
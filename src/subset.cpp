@@ -41,12 +41,17 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <htslib/vcf.h>
 
 #include "gq.h"
+#include "ingest.h"
 
 using namespace vcfaid;
 
 struct Config {
   bool hasIdFile;
   bool hasPosFile;
+  bool index;
+  char outputType;
+  int32_t compressionLevel;
+  uint32_t ioThreads;
   boost::filesystem::path idscorefile;
   boost::filesystem::path posfile;
   boost::filesystem::path outfile;
@@ -86,15 +91,11 @@ _parseScores(TConfig const& c, TScores& scores)
 
 template<typename TConfig, typename TGenomicPos>
 inline void
-_parsePositions(TConfig const& c, TGenomicPos& svpos)
+_parsePositions(TConfig const& c, bcf_hdr_t* hdr, TGenomicPos& svpos)
 {
   typedef typename TGenomicPos::value_type TChrPosPair;
   typedef typename TChrPosPair::value_type TPairSet;
 
-  // Open VCF file
-  htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
-  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
-
   // Get number of sequences
   const char** seqnames = NULL;
   int32_t nseq=0;
@@ -132,22 +133,14 @@ _parsePositions(TConfig const& c, TGenomicPos& svpos)
       }
     }
   }
-
-  // Close VCF
-  bcf_hdr_destroy(hdr);
-  bcf_close(ifile);
 }
 
 template<typename TConfig, typename TGenomicPos, typename TScores>
 inline int32_t 
-_processVCF(TConfig const& c, TGenomicPos const& svpos, TScores const& scores, bool hasScores) {
-
-  // Open VCF file
-  htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
-  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
+_processVCF(TConfig const& c, htsFile* ifile, bcf_hdr_t* hdr, TGenomicPos const& svpos, TScores const& scores, bool hasScores) {
 
   // Open output file
-  htsFile *fp = hts_open(c.outfile.string().c_str(), "wb");
+  htsFile *fp = hts_open(c.outfile.string().c_str(), _outputMode(c.outputType, c.compressionLevel, false).c_str());
   bcf_hdr_t *hdr_out = bcf_hdr_dup(hdr);
   if (hasScores) { 
     bcf_hdr_remove(hdr_out, BCF_HL_INFO, "SCORE");
@@ -161,9 +154,10 @@ _processVCF(TConfig const& c, TGenomicPos const& svpos, TScores const& scores, b
   int32_t nsvend = 0;
   int32_t* svend = NULL;
 
-  // Process records
+  // Process records, text VCF lines are parsed in parallel
+  RecordReader reader(ifile, hdr, c.ioThreads);
   bcf1_t* rec = bcf_init();
-  while (bcf_read(ifile, hdr, rec) == 0) {
+  while (reader.read(rec) == 0) {
     bcf_unpack(rec, BCF_UN_INFO);
     if (c.hasIdFile) {
       std::string svid(rec->d.id);
@@ -201,11 +195,7 @@ _processVCF(TConfig const& c, TGenomicPos const& svpos, TScores const& scores, b
   hts_close(fp);
   
   // Build index
-  bcf_index_build(c.outfile.string().c_str(), 14);
-
-  // Close VCF
-  bcf_hdr_destroy(hdr);
-  bcf_close(ifile);
+  if (c.index) bcf_index_build(c.outfile.string().c_str(), 14);
   return 0;
 }
 
@@ -216,6 +206,7 @@ int main(int argc, char **argv) {
 #endif
 
   Config c;
+  std::string outputType;
 
   // Parameter
   boost::program_options::options_description generic("Generic options");
@@ -223,12 +214,16 @@ int main(int argc, char **argv) {
     ("help,?", "show help message")
     ("tsv,t", boost::program_options::value<boost::filesystem::path>(&c.idscorefile), "tab-delimited file of id & score of variants to keep")
     ("pos,p", boost::program_options::value<boost::filesystem::path>(&c.posfile), "tab-delimited file of chr, start, chr2, end of variants to keep")
-    ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("var.bcf"), "BCF output file")
+    ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("var.bcf"), "output file, - for stdout")
+    ("output-type,O", boost::program_options::value<std::string>(&outputType), "b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: VCF [from file name]")
+    ("compression-level,l", boost::program_options::value<int32_t>(&c.compressionLevel)->default_value(-1), "compression level 0-9 for b/z output (-1: default)")
+    ("io-threads,T", boost::program_options::value<uint32_t>(&c.ioThreads)->default_value(1), "number of decompression and VCF parsing threads")
+    ("no-index", "do not index the output file")
     ;
 
   boost::program_options::options_description hidden("Hidden options");
   hidden.add_options()
-    ("input-file", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file")
+    ("input-file", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input VCF/BCF file, - for stdin")
     ;
 
   boost::program_options::positional_options_description pos_args;
@@ -248,9 +243,24 @@ int main(int argc, char **argv) {
     std::cout << visible_options << "\n";
     return 1;
   } 
+  c.outputType = _outputType(outputType, c.outfile);
+  if (!_validOutputType(c.outputType)) {
+    std::cerr << "Unknown output type: " << outputType << std::endl;
+    return 1;
+  }
+  if (!_validCompressionLevel(c.compressionLevel)) {
+    std::cerr << "Compression level needs to be in [-1, 9]: " << c.compressionLevel << std::endl;
+    return 1;
+  }
+  if ((c.compressionLevel != -1) && (c.outputType != 'b') && (c.outputType != 'z')) {
+    std::cerr << "Compression level requires compressed output (-O b or -O z)!" << std::endl;
+    return 1;
+  }
+  c.index = ((!vm.count("no-index")) && (_indexable(c.outputType, c.outfile)));
+  if (c.ioThreads < 1) c.ioThreads = 1;
   
   // Check VCF file
-  if (!(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
+  if (!_isStream(c.vcffile) && !(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
     std::cerr << "Input VCF/BCF file is missing " << c.vcffile.string() << std::endl;
     return 1;
   }
@@ -275,12 +285,20 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Keep stdout free for the output stream
+  std::streambuf* coutbuf = std::cout.rdbuf();
+  if (_isStream(c.outfile)) std::cout.rdbuf(std::cerr.rdbuf());
+
   // Show cmd
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
   for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
   std::cout << std::endl;
 
+  // Open VCF file, read once so that it can be a stream
+  htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
+  bcf_hdr_t* hdr = bcf_hdr_read(ifile);
+
   // Parse selected Ids and Scores or positions
   typedef std::map<std::string, double> TScores;
   typedef std::pair<int32_t, int32_t> TIntPair;
@@ -291,14 +309,19 @@ int main(int argc, char **argv) {
   TScores scores;
   bool hasScores = false;
   if (c.hasIdFile) hasScores = _parseScores(c, scores);
-  else _parsePositions(c, svpos);
+  else _parsePositions(c, hdr, svpos);
 
   // Filter Ids and add scores
-  int r=_processVCF(c, svpos, scores, hasScores);
+  int r=_processVCF(c, ifile, hdr, svpos, scores, hasScores);
+
+  // Close VCF
+  bcf_hdr_destroy(hdr);
+  bcf_close(ifile);
 
   // End
   now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+  std::cout.rdbuf(coutbuf);
 
 
 
@@ -0,0 +1,292 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#define BOOST_TEST_MODULE kernels
+#include <boost/test/included/unit_test.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/math/special_functions/round.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+#include "arfer.h"
+#include "batch.h"
+
+using namespace vcfaid;
+
+// Tolerances of the fast paths against the double-precision reference templates
+static const double TOL_FLOAT_AF = 1e-4;
+static const double TOL_FLOAT_GF = 1e-4;
+static const double TOL_FLOAT_GQ = 0.5;
+static const double TOL_KAHAN = 1e-10;
+static const double TOL_PL = 1e-5;
+
+struct Config {
+  uint32_t maxiter;
+  double epsilon;
+
+  Config() : maxiter(1000), epsilon(1e-20) {}
+};
+
+// Random cohort of one site: raw GLs (log10) and the matching PLs, the true genotype of every sample has GL 0
+template<int P>
+struct RawSite {
+  std::vector<boost::array<float, P + 1> > gl;
+  std::vector<boost::array<int32_t, P + 1> > pl;
+  uint32_t nalt;
+};
+
+template<int P>
+inline void
+_randomRawSite(std::size_t const nsamples, double const af, double const noise, boost::random::mt19937& rng, RawSite<P>& site) {
+  boost::random::uniform_real_distribution<double> dist(0, 1);
+  site.gl.resize(nsamples);
+  site.pl.resize(nsamples);
+  site.nalt = 0;
+  for(std::size_t i = 0; i < nsamples; ++i) {
+    int32_t gt = 0;
+    for(int j = 0; j < P; ++j) gt += (dist(rng) < af);
+    site.nalt += gt;
+    for(int k = 0; k < P + 1; ++k) {
+      // PL precision, so that GL and PL input describe the same likelihoods
+      int32_t pl = (k == gt) ? 0 : (int32_t) boost::math::iround(noise * 10 * dist(rng));
+      site.pl[i][k] = pl;
+      site.gl[i][k] = (float) pl / (float) -10.0;
+    }
+  }
+}
+
+template<typename TGLs, typename TRawGLs>
+inline void
+_likelihoods(std::vector<TRawGLs> const& raw, std::vector<TGLs>& lik) {
+  lik.resize(raw.size());
+  for(std::size_t i = 0; i < raw.size(); ++i) _scaledLikelihoods(&raw[i][0], lik[i]);
+}
+
+template<typename TValue>
+inline bool
+_identical(BiallelicEstimate<TValue> const& a, BiallelicEstimate<TValue> const& b) {
+  return (std::memcmp(&a, &b, sizeof(BiallelicEstimate<TValue>)) == 0);
+}
+
+template<typename TGlVector, typename TValue>
+inline void
+_checkProperties(TGlVector const& lik, BiallelicEstimate<TValue> const& est, int const ploidy) {
+  BOOST_CHECK((est.hweAF[1] >= 0) && (est.hweAF[1] <= 1));
+  BOOST_CHECK_SMALL((double) (est.hweAF[0] + est.hweAF[1] - 1), 1e-5);
+  double sumGF = 0;
+  for(int k = 0; k < 3; ++k) {
+    BOOST_CHECK((est.mleGTFreq[k] >= 0) && (est.mleGTFreq[k] <= 1));
+    sumGF += est.mleGTFreq[k];
+  }
+  BOOST_CHECK_SMALL(sumGF - 1, 1e-5);
+  BOOST_CHECK(est.rsq >= 0);
+  if (ploidy == 2) {
+    BOOST_CHECK(est.fic <= 1);
+    BOOST_CHECK((est.hwepval >= 0) && (est.hwepval <= 1));
+  }
+  for(typename TGlVector::const_iterator itG = lik.begin(); itG != lik.end(); ++itG) {
+    float gq = _sampleGQ(*itG, est.mleGTFreq);
+    BOOST_CHECK((gq >= 0) && (gq <= 99));
+    BOOST_CHECK_EQUAL(gq * 10, std::floor(gq * 10 + (float) 0.5));
+  }
+}
+
+// Small cohorts with estimates of the double-precision reference, a change of these values changes the output of gq
+BOOST_AUTO_TEST_CASE(golden_cohorts) {
+  Config c;
+  float gl[8][3] = {{0, -2, -5}, {0, -1.5, -4}, {-3, 0, -3}, {-0.5, 0, -2}, {-6, -2, 0}, {0, -0.3, -1}, {-2, 0, -4}, {0, -3, -8}};
+  std::vector<boost::array<double, 3> > dip(8);
+  for(int i = 0; i < 8; ++i) _scaledLikelihoods(gl[i], dip[i]);
+  BiallelicEstimate<double> est;
+  _estBiallelic(c, dip, est);
+  BOOST_CHECK_CLOSE(est.hweAF[1], 0.31728405734428961, 1e-8);
+  BOOST_CHECK_CLOSE(est.mleGTFreq[0], 0.49857564452458542, 1e-8);
+  BOOST_CHECK_CLOSE(est.mleGTFreq[1], 0.37757505150907855, 1e-8);
+  BOOST_CHECK_CLOSE(est.mleGTFreq[2], 0.12384930396633602, 1e-8);
+  BOOST_CHECK_CLOSE(est.fic, 0.09804975802269511, 1e-8);
+  BOOST_CHECK_CLOSE(est.rsq, 1.0784118145754167, 1e-8);
+  BOOST_CHECK_CLOSE(est.hwepval, 0.75949951578513886, 1e-8);
+  float gq[8] = {21.2, 16.3, 27.8, 5.3, 15.3, 5.4, 18.8, 31.2};
+  for(int i = 0; i < 8; ++i) BOOST_CHECK_EQUAL(_sampleGQ(dip[i], est.mleGTFreq), gq[i]);
+
+  // Haploid PLs
+  int32_t pl[6][2] = {{0, 30}, {0, 12}, {25, 0}, {40, 0}, {0, 3}, {0, 60}};
+  std::vector<boost::array<double, 2> > hap(6);
+  for(int i = 0; i < 6; ++i) _scaledLikelihoods(pl[i], hap[i]);
+  _estBiallelic(c, hap, est);
+  BOOST_CHECK_CLOSE(est.hweAF[1], 0.37753877781821582, 1e-8);
+  BOOST_CHECK_CLOSE(est.mleGTFreq[0], 0.62246122218178412, 1e-8);
+  BOOST_CHECK_CLOSE(est.rsq, 1.0125936157285751, 1e-8);
+  float hgq[6] = {32.2, 14.3, 22.9, 37.8, 6.3, 62.2};
+  for(int i = 0; i < 6; ++i) BOOST_CHECK_EQUAL(_sampleGQ(hap[i], est.mleGTFreq), hgq[i]);
+}
+
+BOOST_AUTO_TEST_CASE(estimate_properties) {
+  Config c;
+  boost::random::mt19937 rng(11);
+  double afs[] = {0.001, 0.05, 0.3, 0.5, 0.97};
+  double noise[] = {0.5, 5, 30, 300};
+  for(int a = 0; a < 5; ++a) {
+    for(int n = 0; n < 4; ++n) {
+      RawSite<2> dsite;
+      _randomRawSite(500, afs[a], noise[n], rng, dsite);
+      std::vector<boost::array<double, 3> > dlik;
+      _likelihoods(dsite.gl, dlik);
+      BiallelicEstimate<double> dest;
+      _estBiallelic(c, dlik, dest);
+      _checkProperties(dlik, dest, 2);
+      std::vector<boost::array<float, 3> > flik;
+      _likelihoods(dsite.gl, flik);
+      BiallelicEstimate<float> fest;
+      _estBiallelic(c, flik, fest);
+      _checkProperties(flik, fest, 2);
+
+      RawSite<1> hsite;
+      _randomRawSite(500, afs[a], noise[n], rng, hsite);
+      std::vector<boost::array<double, 2> > hlik;
+      _likelihoods(hsite.pl, hlik);
+      BiallelicEstimate<double> hest;
+      _estBiallelic(c, hlik, hest);
+      _checkProperties(hlik, hest, 1);
+    }
+  }
+
+  // Extreme and missing likelihoods: GQ is capped, uninformative samples get GQ 0
+  std::vector<boost::array<double, 3> > lik(2);
+  float certain[3] = {0, -300, -300};
+  _scaledLikelihoods(certain, lik[0]);
+  int32_t missing[3] = {INT32_MIN, INT32_MIN, INT32_MIN};  // bcf_int32_missing
+  _scaledLikelihoods(missing, lik[1]);
+  BiallelicEstimate<double> est;
+  _estBiallelic(c, lik, est);
+  BOOST_CHECK_EQUAL(_sampleGQ(lik[0], est.mleGTFreq), 99);
+  BOOST_CHECK_EQUAL(_sampleGQ(lik[1], est.mleGTFreq), 0);
+}
+
+// Confident haploid calls estimate the allele count
+BOOST_AUTO_TEST_CASE(haploid_allele_count) {
+  Config c;
+  boost::random::mt19937 rng(5);
+  for(int s = 0; s < 10; ++s) {
+    RawSite<1> site;
+    _randomRawSite(1000, 0.05 + 0.09 * s, 1000, rng, site);
+    std::vector<boost::array<double, 2> > lik;
+    _likelihoods(site.gl, lik);
+    BiallelicEstimate<double> est;
+    _estBiallelic(c, lik, est);
+    BOOST_CHECK_SMALL(est.hweAF[1] - (double) site.nalt / 1000.0, 1e-3);
+  }
+}
+
+// Fast paths against the double-precision reference with the default summation
+BOOST_AUTO_TEST_CASE(differential_fast_paths) {
+  typedef boost::array<double, 3> TGLs;
+  Config c;
+  boost::random::mt19937 rng(23);
+  boost::random::uniform_real_distribution<double> dist(0, 1);
+  double maxGQ = 0;
+  for(int s = 0; s < 40; ++s) {
+    RawSite<2> site;
+    _randomRawSite(200 + 50 * s, 0.5 * dist(rng), 1 + 50 * dist(rng), rng, site);
+    std::vector<TGLs> dlik;
+    _likelihoods(site.gl, dlik);
+    BiallelicEstimate<double> ref;
+    _estBiallelic(c, dlik, ref);
+
+    // Single precision
+    std::vector<boost::array<float, 3> > flik;
+    _likelihoods(site.gl, flik);
+    BiallelicEstimate<float> fest;
+    _estBiallelic(c, flik, fest);
+    BOOST_CHECK_SMALL(ref.hweAF[1] - (double) fest.hweAF[1], TOL_FLOAT_AF);
+    for(int k = 0; k < 3; ++k) BOOST_CHECK_SMALL(ref.mleGTFreq[k] - (double) fest.mleGTFreq[k], TOL_FLOAT_GF);
+    for(std::size_t i = 0; i < dlik.size(); ++i) maxGQ = std::max(maxGQ, (double) std::abs(_sampleGQ(dlik[i], ref.mleGTFreq) - _sampleGQ(flik[i], fest.mleGTFreq)));
+
+    // Compensated summation
+    BiallelicEstimate<double> kest;
+    _estBiallelic<KahanSum<double> >(c, dlik, kest);
+    BOOST_CHECK_SMALL(ref.hweAF[1] - kest.hweAF[1], TOL_KAHAN);
+    for(int k = 0; k < 3; ++k) BOOST_CHECK_SMALL(ref.mleGTFreq[k] - kest.mleGTFreq[k], TOL_KAHAN);
+
+    // PL kernel (phred table) against the GL kernel (pow) for the same likelihoods
+    std::vector<TGLs> plik;
+    _likelihoods(site.pl, plik);
+    BiallelicEstimate<double> pest;
+    _estBiallelic(c, plik, pest);
+    BOOST_CHECK_SMALL(ref.hweAF[1] - pest.hweAF[1], TOL_PL);
+    for(int k = 0; k < 3; ++k) BOOST_CHECK_SMALL(ref.mleGTFreq[k] - pest.mleGTFreq[k], TOL_PL);
+    BOOST_CHECK_SMALL(ref.rsq - pest.rsq, TOL_PL);
+  }
+  BOOST_CHECK_SMALL(maxGQ, TOL_FLOAT_GQ);
+}
+
+// The batch engine gives the single-site estimates for any batch size
+BOOST_AUTO_TEST_CASE(differential_batch) {
+  typedef boost::array<double, 3> TGLs;
+  Config c;
+  boost::random::mt19937 rng(31);
+  std::vector<std::vector<TGLs> > sites(16);
+  std::vector<BiallelicEstimate<double> > ref(sites.size());
+  for(std::size_t s = 0; s < sites.size(); ++s) {
+    RawSite<2> site;
+    _randomRawSite(100 + 97 * s, 0.03 * s, 20, rng, site);
+    _likelihoods(site.gl, sites[s]);
+    _estBiallelic(c, sites[s], ref[s]);
+  }
+  uint32_t batchSizes[] = {2, 7, 16};
+  for(uint32_t b = 0; b < 3; ++b) {
+    for(std::size_t start = 0; start < sites.size(); start += batchSizes[b]) {
+      std::size_t end = std::min(sites.size(), start + batchSizes[b]);
+      std::vector<std::vector<TGLs> > block(sites.begin() + start, sites.begin() + end);
+      SiteBatch<TGLs> batch;
+      _tileBatch(block, 32768, batch);
+      std::vector<BiallelicEstimate<double> > est;
+      _estBiallelicBatch(c, batch, est);
+      for(std::size_t s = start; s < end; ++s) BOOST_CHECK(_identical(ref[s], est[s - start]));
+    }
+  }
+}
+
+// Estimates depend only on the likelihoods, not on previous calls (e.g. the static phred table)
+BOOST_AUTO_TEST_CASE(determinism) {
+  Config c;
+  boost::random::mt19937 rng(47);
+  RawSite<2> site;
+  _randomRawSite(3000, 0.2, 40, rng, site);
+  std::vector<boost::array<float, 3> > lik;
+  _likelihoods(site.pl, lik);
+  BiallelicEstimate<float> first;
+  _estBiallelic(c, lik, first);
+  for(int r = 0; r < 3; ++r) {
+    std::vector<boost::array<float, 3> > again;
+    _likelihoods(site.pl, again);
+    BiallelicEstimate<float> est;
+    _estBiallelic(c, again, est);
+    BOOST_CHECK(_identical(first, est));
+  }
+}
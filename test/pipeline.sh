@@ -0,0 +1,103 @@
+#!/bin/sh
+# Compares the gq output of small fixed inputs with their expected output (test/data). Then runs gq on a synthetic
+# cohort with 1 and 4 worker threads (and parallel input parsing) and compares the outputs byte for byte, for the
+# default, single-precision, batched, memory-bounded and reproducible modes. The memory-bounded mode reads the packed
+# FORMAT fields and has to give the output and the cache keys of the default mode, and a checkpointed run that is
+# killed and resumed has to give the output of an uninterrupted run.
+
+GQ=${GQ:-./src/gq}
+BGZIP=${BGZIP:-bgzip}
+DATA=$(dirname "$0")/data
+TMP=$(mktemp -d)
+trap 'rm -rf "${TMP}"' EXIT
+status=0
+
+# Diploid and haploid PL and GL sites, haploid samples at diploid sites, missing genotypes and a multi-allelic site
+for name in pl gl; do
+  ${GQ} -g 20 -O v -o "${TMP}/${name}.g20.vcf" "${DATA}/${name}.vcf" > /dev/null || exit 1
+  ${GQ} -s -O v -o "${TMP}/${name}.sites.vcf" "${DATA}/${name}.vcf" > /dev/null || exit 1
+  for out in g20 sites; do
+    if cmp -s "${DATA}/${name}.${out}.vcf" "${TMP}/${name}.${out}.vcf"; then
+      echo "gq ${name}.vcf: ${name}.${out}.vcf as expected"
+    else
+      echo "gq ${name}.vcf: output differs from ${name}.${out}.vcf"
+      status=1
+    fi
+  done
+done
+
+# 600 samples (more than two summation tiles), biallelic sites with varying allele frequency and missing genotypes.
+# The cohort depends on the awk implementation, it is only compared with itself.
+awk -v nsamples=600 -v nsites=1500 'BEGIN {
+  srand(11);
+  print "##fileformat=VCFv4.2";
+  print "##contig=<ID=chr1,length=10000000>";
+  print "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">";
+  print "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred-scaled genotype likelihoods\">";
+  line = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+  for(s = 0; s < nsamples; ++s) line = line "\tS" s;
+  print line;
+  for(i = 0; i < nsites; ++i) {
+    af = rand() * rand();
+    line = "chr1\t" (1000 + 10 * i) "\t.\tA\tG\t.\tPASS\t.\tGT:PL";
+    for(s = 0; s < nsamples; ++s) {
+      if (rand() < 0.02) {
+        line = line "\t./.:.";
+        continue;
+      }
+      g = (rand() < af) + (rand() < af);
+      gt = (g == 0) ? "0/0" : ((g == 1) ? "0/1" : "1/1");
+      for(k = 0; k < 3; ++k) pl[k] = (k == g) ? 0 : int(rand() * 60) + 1;
+      line = line "\t" gt ":" pl[0] "," pl[1] "," pl[2];
+    }
+    print line;
+  }
+}' > "${TMP}/input.vcf"
+
+for opts in "" "-f" "-b 16" "-M 1" "-x" "-x -f -b 16"; do
+  ${GQ} ${opts} -g 20 -t 1 -O v -o "${TMP}/t1.vcf" "${TMP}/input.vcf" > /dev/null || exit 1
+  ${GQ} ${opts} -g 20 -t 4 -O v -o "${TMP}/t4.vcf" "${TMP}/input.vcf" > /dev/null || exit 1
+  ${GQ} ${opts} -g 20 -t 4 -T 4 -O v -o "${TMP}/t4T4.vcf" "${TMP}/input.vcf" > /dev/null || exit 1
+  if cmp -s "${TMP}/t1.vcf" "${TMP}/t4.vcf" && cmp -s "${TMP}/t1.vcf" "${TMP}/t4T4.vcf"; then
+    echo "gq ${opts}: identical output for 1 and 4 threads"
+  else
+    echo "gq ${opts}: output differs between 1 and 4 threads"
+    status=1
+  fi
+done
+
+for opts in "" "-f" "-x"; do
+  ${GQ} ${opts} -g 20 -t 4 -O v -o "${TMP}/default.vcf" -C "${TMP}/cache.bin" "${TMP}/input.vcf" > /dev/null || exit 1
+  ${GQ} ${opts} -g 20 -t 4 -M 1 -O v -o "${TMP}/bounded.vcf" -C "${TMP}/cache.bin" "${TMP}/input.vcf" > "${TMP}/bounded.log" || exit 1
+  if cmp -s "${TMP}/default.vcf" "${TMP}/bounded.vcf" && grep -q "Result cache: 1500 sites reused, 0 sites estimated" "${TMP}/bounded.log"; then
+    echo "gq ${opts} -M 1: identical output and cache keys as without -M"
+  else
+    echo "gq ${opts} -M 1: output or cache keys differ from the run without -M"
+    status=1
+  fi
+  rm -f "${TMP}/cache.bin"
+done
+
+# A run killed after its first checkpoint and resumed writes the output of an uninterrupted run
+${BGZIP} -c "${TMP}/input.vcf" > "${TMP}/input.vcf.gz" || exit 1
+${GQ} -g 20 -c 10 -O z -o "${TMP}/full.vcf.gz" "${TMP}/input.vcf.gz" > /dev/null || exit 1
+${GQ} -g 20 -c 10 -O z -o "${TMP}/resumed.vcf.gz" "${TMP}/input.vcf.gz" > /dev/null &
+pid=$!
+while kill -0 ${pid} 2> /dev/null && [ ! -f "${TMP}/resumed.vcf.gz.ckpt" ]; do :; done
+kill -9 ${pid} 2> /dev/null
+wait ${pid} 2> /dev/null
+if [ ! -f "${TMP}/resumed.vcf.gz.ckpt" ]; then
+  echo "gq -c 10: run finished before it could be interrupted"
+  status=1
+else
+  ${GQ} -g 20 -c 10 -r -O z -o "${TMP}/resumed.vcf.gz" "${TMP}/input.vcf.gz" > "${TMP}/resumed.log" || exit 1
+  gzip -dc "${TMP}/full.vcf.gz" > "${TMP}/full.vcf" || exit 1
+  gzip -dc "${TMP}/resumed.vcf.gz" > "${TMP}/resumed.vcf" || exit 1
+  if grep -q "Resuming after" "${TMP}/resumed.log" && cmp -s "${TMP}/full.vcf" "${TMP}/resumed.vcf"; then
+    echo "gq -c 10 -r: resumed output identical to the uninterrupted run"
+  else
+    echo "gq -c 10 -r: resumed output differs from the uninterrupted run"
+    status=1
+  fi
+fi
+exit ${status}
@@ -0,0 +1,112 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#define BOOST_TEST_MODULE reproducible
+#include <boost/test/included/unit_test.hpp>
+
+#include <cstring>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+#include "arfer.h"
+#include "batch.h"
+
+using namespace vcfaid;
+
+struct Config {
+  uint32_t maxiter;
+  double epsilon;
+
+  Config() : maxiter(1000), epsilon(1e-20) {}
+};
+
+// Random GL triples with a most likely genotype drawn from the given allele frequency
+template<typename TGLs>
+inline void
+_randomSites(std::size_t const nsites, std::size_t const nsamples, uint32_t const seed, std::vector<std::vector<TGLs> >& sites) {
+  boost::random::mt19937 rng(seed);
+  boost::random::uniform_real_distribution<double> dist(0, 1);
+  sites.resize(nsites);
+  for(std::size_t s = 0; s < nsites; ++s) {
+    double af = 0.01 + 0.49 * dist(rng);
+    sites[s].resize(nsamples - s);
+    for(std::size_t i = 0; i < sites[s].size(); ++i) {
+      int32_t gt = (dist(rng) < af) + (dist(rng) < af);
+      float gl[3];
+      for(int k = 0; k < 3; ++k) gl[k] = (k == gt) ? 0 : (float) (-10.0 * dist(rng));
+      _scaledLikelihoods(gl, sites[s][i]);
+    }
+  }
+}
+
+template<typename TValue>
+inline bool
+_identical(BiallelicEstimate<TValue> const& a, BiallelicEstimate<TValue> const& b) {
+  return (std::memcmp(&a, &b, sizeof(BiallelicEstimate<TValue>)) == 0);
+}
+
+template<typename TValue>
+inline void
+_checkBatchPartitions() {
+  typedef boost::array<TValue, 3> TGLs;
+  typedef BlockedSum<TValue> TSum;
+  Config c;
+  std::vector<std::vector<TGLs> > sites;
+  _randomSites<TGLs>(12, 2000, 7, sites);
+
+  // Single-site reference
+  std::vector<BiallelicEstimate<TValue> > ref(sites.size());
+  for(std::size_t s = 0; s < sites.size(); ++s) _estBiallelic<TSum>(c, sites[s], ref[s]);
+
+  // Any batch size and sample tiling
+  uint32_t batchSizes[] = {1, 3, 5, 12};
+  std::size_t cacheBytes[] = {1, 4096, 65536, 1 << 24};
+  for(uint32_t b = 0; b < 4; ++b) {
+    for(uint32_t k = 0; k < 4; ++k) {
+      for(std::size_t start = 0; start < sites.size(); start += batchSizes[b]) {
+	std::size_t end = std::min(sites.size(), start + batchSizes[b]);
+	std::vector<std::vector<TGLs> > block(sites.begin() + start, sites.begin() + end);
+	SiteBatch<TGLs> batch;
+	_tileBatch(block, cacheBytes[k], batch);
+	std::vector<BiallelicEstimate<TValue> > est;
+	_estBiallelicBatch<TSum>(c, batch, est);
+	for(std::size_t s = start; s < end; ++s) BOOST_CHECK(_identical(ref[s], est[s - start]));
+      }
+    }
+  }
+
+  // Same estimates as the default summation up to rounding
+  for(std::size_t s = 0; s < sites.size(); ++s) {
+    BiallelicEstimate<TValue> est;
+    _estBiallelic(c, sites[s], est);
+    BOOST_CHECK_SMALL((double) (est.hweAF[1] - ref[s].hweAF[1]), (sizeof(TValue) == sizeof(float)) ? 1e-4 : 1e-10);
+    BOOST_CHECK_SMALL((double) (est.rsq - ref[s].rsq), (sizeof(TValue) == sizeof(float)) ? 1e-3 : 1e-10);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(blocked_sum_batch_partitions) {
+  _checkBatchPartitions<double>();
+  _checkBatchPartitions<float>();
+}
@@ -0,0 +1,245 @@
+/*
+============================================================================
+VCFaid
+============================================================================
+Copyright (C) 2016 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+#define BOOST_TEST_MODULE stream
+#include <boost/test/included/unit_test.hpp>
+
+#include <cstring>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <htslib/vcf.h>
+
+#include "arfer.h"
+#include "cache.h"
+#include "qc.h"
+#include "stream.h"
+
+using namespace vcfaid;
+
+struct Config {
+  uint32_t maxiter;
+  double epsilon;
+
+  Config() : maxiter(1000), epsilon(1e-20) {}
+};
+
+// Unpacked GT and PL/GL arrays of one site (as bcf_get_genotypes and bcf_get_format_* return them) and their packed
+// FORMAT fields, the width of the packed integers is the BCF type of the field
+template<int P>
+struct PackedSite {
+  int32_t nsamples;
+  std::vector<int32_t> gt;
+  std::vector<int32_t> pl;
+  std::vector<float> gl;
+  std::vector<uint8_t> pgt;
+  std::vector<uint8_t> ppl;
+  std::vector<uint8_t> pgl;
+  bcf_fmt_t fgt;
+  bcf_fmt_t fpl;
+  bcf_fmt_t fgl;
+};
+
+inline void
+_packInt(std::vector<int32_t> const& vals, int32_t const n, int32_t const type, std::vector<uint8_t>& buf, bcf_fmt_t& fmt) {
+  int32_t width = (type == BCF_BT_INT8) ? sizeof(int8_t) : ((type == BCF_BT_INT16) ? sizeof(int16_t) : sizeof(int32_t));
+  buf.resize(vals.size() * width);
+  for(std::size_t k = 0; k < vals.size(); ++k) {
+    int32_t v = vals[k];
+    if (type == BCF_BT_INT8) {
+      int8_t p = (v == bcf_int32_missing) ? bcf_int8_missing : ((v == bcf_int32_vector_end) ? bcf_int8_vector_end : v);
+      std::memcpy(&buf[k * width], &p, width);
+    } else if (type == BCF_BT_INT16) {
+      int16_t p = (v == bcf_int32_missing) ? bcf_int16_missing : ((v == bcf_int32_vector_end) ? bcf_int16_vector_end : v);
+      std::memcpy(&buf[k * width], &p, width);
+    } else std::memcpy(&buf[k * width], &v, width);
+  }
+  std::memset(&fmt, 0, sizeof(bcf_fmt_t));
+  fmt.n = n;
+  fmt.size = n * width;
+  fmt.type = type;
+  fmt.p = &buf[0];
+  fmt.p_len = buf.size();
+}
+
+inline void
+_packFloat(std::vector<float> const& vals, int32_t const n, std::vector<uint8_t>& buf, bcf_fmt_t& fmt) {
+  buf.resize(vals.size() * sizeof(float));
+  std::memcpy(&buf[0], &vals[0], buf.size());
+  std::memset(&fmt, 0, sizeof(bcf_fmt_t));
+  fmt.n = n;
+  fmt.size = n * sizeof(float);
+  fmt.type = BCF_BT_FLOAT;
+  fmt.p = &buf[0];
+  fmt.p_len = buf.size();
+}
+
+// Random site with missing genotypes and, for diploid sites, haploid samples. maxPL selects the packed integer width.
+template<int P>
+inline void
+_randomPackedSite(int32_t const nsamples, double const af, int32_t const maxPL, int32_t const type, boost::random::mt19937& rng, PackedSite<P>& site) {
+  boost::random::uniform_real_distribution<double> dist(0, 1);
+  site.nsamples = nsamples;
+  site.gt.resize(nsamples * P);
+  site.pl.resize(nsamples * (P + 1));
+  site.gl.resize(nsamples * (P + 1));
+  for(int32_t i = 0; i < nsamples; ++i) {
+    int32_t* gt = &site.gt[i * P];
+    int32_t* pl = &site.pl[i * (P + 1)];
+    float* gl = &site.gl[i * (P + 1)];
+    bool missing = (dist(rng) < 0.05);
+    bool haploid = ((P == 2) && (dist(rng) < 0.05));
+    int32_t nalt = 0;
+    for(int j = 0; j < P; ++j) {
+      int32_t a = (dist(rng) < af);
+      gt[j] = (missing) ? bcf_gt_missing : bcf_gt_unphased(a);
+      nalt += a;
+    }
+    if (haploid) gt[P - 1] = bcf_int32_vector_end;
+    int32_t nlik = (haploid) ? 2 : P + 1;
+    for(int k = 0; k < P + 1; ++k) {
+      if (k < nlik) {
+	pl[k] = (k == nalt) ? 0 : (int32_t) (maxPL * dist(rng));
+	gl[k] = (float) pl[k] / (float) -10.0;
+      } else {
+	pl[k] = bcf_int32_vector_end;
+	gl[k] = 0;
+      }
+    }
+  }
+  _packInt(site.gt, P, type, site.pgt, site.fgt);
+  _packInt(site.pl, P + 1, type, site.ppl, site.fpl);
+  _packFloat(site.gl, P + 1, site.pgl, site.fgl);
+}
+
+template<typename TValue>
+inline bool
+_identical(BiallelicEstimate<TValue> const& a, BiallelicEstimate<TValue> const& b) {
+  return (std::memcmp(&a, &b, sizeof(BiallelicEstimate<TValue>)) == 0);
+}
+
+// The streamed site decodes the same likelihoods as the unpacked arrays for any block size, so the estimates and GQs
+// of the memory-bounded mode are bit-identical to the default mode
+template<int P, typename TValue, typename TSum, typename TRaw>
+inline void
+_checkStreamedSite(Config const& c, int32_t const nsamples, TRaw const* raw, int32_t const* gt, bcf_fmt_t const* fgl, bcf_fmt_t const* fgt) {
+  typedef boost::array<TValue, P + 1> TGLs;
+  typedef StreamedSite<P, TRaw, TGLs> TStreamedSite;
+  std::vector<TGLs> glVector;
+  _siteLikelihoods<P>(nsamples, raw, gt, glVector);
+  BiallelicEstimate<TValue> ref;
+  _estBiallelic<TSum>(c, glVector, ref);
+  std::size_t blockSizes[] = {1, 7, 256, (std::size_t) nsamples + 1};
+  for(uint32_t b = 0; b < 4; ++b) {
+    TStreamedSite site(fgl, fgt, nsamples, blockSizes[b]);
+    BOOST_REQUIRE_EQUAL(site.size(), glVector.size());
+    std::size_t i = 0;
+    for(typename TStreamedSite::const_iterator itG = site.begin(); itG != site.end(); ++itG, ++i) BOOST_CHECK(std::memcmp(&*itG, &glVector[i], sizeof(TGLs)) == 0);
+    BOOST_CHECK_EQUAL(i, glVector.size());
+    BiallelicEstimate<TValue> est;
+    _estBiallelic<TSum>(c, site, est);
+    BOOST_CHECK(_identical(ref, est));
+    i = 0;
+    for(typename TStreamedSite::const_iterator itG = site.begin(); itG != site.end(); ++itG, ++i) BOOST_CHECK_EQUAL(_sampleGQ(*itG, est.mleGTFreq), _sampleGQ(glVector[i], ref.mleGTFreq));
+  }
+}
+
+template<int P>
+inline void
+_checkStreamedSites(uint32_t const seed) {
+  Config c;
+  boost::random::mt19937 rng(seed);
+  int32_t types[] = {BCF_BT_INT8, BCF_BT_INT16, BCF_BT_INT32};
+  int32_t maxPL[] = {127, 3000, 100000};
+  for(int t = 0; t < 3; ++t) {
+    PackedSite<P> site;
+    _randomPackedSite(1000, 0.2, maxPL[t], types[t], rng, site);
+    _checkStreamedSite<P, double, PlainSum<double> >(c, site.nsamples, &site.pl[0], &site.gt[0], &site.fpl, &site.fgt);
+    _checkStreamedSite<P, double, BlockedSum<double> >(c, site.nsamples, &site.pl[0], &site.gt[0], &site.fpl, &site.fgt);
+    _checkStreamedSite<P, float, SumTraits<float>::TSum>(c, site.nsamples, &site.pl[0], &site.gt[0], &site.fpl, &site.fgt);
+    _checkStreamedSite<P, double, PlainSum<double> >(c, site.nsamples, &site.gl[0], &site.gt[0], &site.fgl, &site.fgt);
+    _checkStreamedSite<P, float, BlockedSum<float> >(c, site.nsamples, &site.gl[0], &site.gt[0], &site.fgl, &site.fgt);
+  }
+}
+
+template<int P>
+inline void
+_checkPackedSiteHash(uint32_t const seed) {
+  boost::random::mt19937 rng(seed);
+  int32_t types[] = {BCF_BT_INT8, BCF_BT_INT16, BCF_BT_INT32};
+  int32_t maxPL[] = {127, 3000, 100000};
+  for(int t = 0; t < 3; ++t) {
+    PackedSite<P> site;
+    _randomPackedSite(500, 0.3, maxPL[t], types[t], rng, site);
+    uint64_t hpl = _siteHash(P, site.nsamples, &site.pl[0], &site.gt[0]);
+    uint64_t hgl = _siteHash(P, site.nsamples, &site.gl[0], &site.gt[0]);
+    BOOST_CHECK_EQUAL((_packedSiteHash<P, int32_t>(site.nsamples, &site.fpl, &site.fgt)), hpl);
+    BOOST_CHECK_EQUAL((_packedSiteHash<P, float>(site.nsamples, &site.fgl, &site.fgt)), hgl);
+
+    // Another likelihood is another key
+    site.pl[P] += 1;
+    _packInt(site.pl, P + 1, types[t], site.ppl, site.fpl);
+    uint64_t hmod = _siteHash(P, site.nsamples, &site.pl[0], &site.gt[0]);
+    BOOST_CHECK(hmod != hpl);
+    BOOST_CHECK_EQUAL((_packedSiteHash<P, int32_t>(site.nsamples, &site.fpl, &site.fgt)), hmod);
+  }
+}
+
+// A haploid sample of a diploid site counts as hom-alt and adds no heterozygosity terms to F
+BOOST_AUTO_TEST_CASE(sample_qc_haploid_in_diploid) {
+  double hweAF[2] = {0.6, 0.4};
+  int32_t pl[6] = {40, 0, bcf_int32_vector_end, 30, 0, 25};
+  int32_t gt[4] = {bcf_gt_unphased(1), bcf_int32_vector_end, bcf_gt_unphased(0), bcf_gt_unphased(1)};
+  boost::array<double, 3> lik;
+  SampleQC hap;
+  _sampleLikelihoods<2>(&pl[0], &gt[0], lik);
+  _sampleQC<2>(lik, &gt[0], 40, false, hweAF, hap);
+  BOOST_CHECK_EQUAL(hap.ncalled, 1);
+  BOOST_CHECK_EQUAL(hap.nhomalt, 1);
+  BOOST_CHECK_EQUAL(hap.nhet, 0);
+  BOOST_CHECK_EQUAL(hap.obsHet, 0);
+  BOOST_CHECK_EQUAL(hap.expHet, 0);
+
+  // A diploid het. sample still does
+  SampleQC dip;
+  _sampleLikelihoods<2>(&pl[3], &gt[2], lik);
+  _sampleQC<2>(lik, &gt[2], 25, false, hweAF, dip);
+  BOOST_CHECK_EQUAL(dip.nhet, 1);
+  BOOST_CHECK(dip.obsHet > 0);
+  BOOST_CHECK_EQUAL(dip.expHet, boost::math::llround(2 * 0.6 * 0.4 * QC_FIXED_POINT));
+}
+
+BOOST_AUTO_TEST_CASE(streamed_site_diploid) {
+  _checkStreamedSites<2>(13);
+}
+
+BOOST_AUTO_TEST_CASE(streamed_site_haploid) {
+  _checkStreamedSites<1>(17);
+}
+
+// Both record paths look up a site under the same cache key, whatever the packed integer width
+BOOST_AUTO_TEST_CASE(packed_site_hash) {
+  _checkPackedSiteHash<2>(19);
+  _checkPackedSiteHash<1>(29);
+}